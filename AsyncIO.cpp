@@ -0,0 +1,326 @@
+#include "AsyncIO.h"
+#ifndef _WIN32
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+bool writeVectored(FILE* filePtr, const IoVec* iov, unsigned int count) {
+	fflush(filePtr);
+	const int fd = fileno(filePtr);
+	struct iovec local[IOV_MAX];
+	unsigned int first = 0;
+	size_t skip = 0;
+	while (first < count) {
+		// the not yet written part, at most IOV_MAX buffers per call
+		unsigned int n = 0;
+		for (unsigned int i = first; i < count && n < IOV_MAX; i++, n++) {
+			local[n] = iov[i];
+			if (i == first) {
+				local[n].iov_base = static_cast<char*>(iov[i].iov_base) + skip;
+				local[n].iov_len -= skip;
+			}
+		}
+		ssize_t written = writev(fd, local, static_cast<int>(n));
+		if (written < 0 && errno == EINTR) continue;
+		if (written < 0) return false;
+		// step over what was written
+		size_t left = static_cast<size_t>(written);
+		while (first < count && left >= iov[first].iov_len - skip) {
+			left -= iov[first].iov_len - skip;
+			skip = 0;
+			first++;
+		}
+		skip += left;
+	}
+	return true;
+}
+#else
+bool writeVectored(FILE* filePtr, const IoVec* iov, unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, filePtr) != iov[i].iov_len)
+			return false;
+	}
+	return true;
+}
+#endif
+
+#if TGA_IO_URING
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the syscall numbers are shared by every architecture
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+// a single read or write is kept well below the 32 bit length field
+#define MAX_REQUEST_BYTES (1u << 30)
+
+static int ringSetup(unsigned int entries, struct io_uring_params* p) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int ringEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0));
+}
+
+static int ringRegister(int fd, unsigned int opcode, const void* arg, unsigned int count) {
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// the kernel reads the tail we publish and writes the heads we read
+static inline unsigned int loadAcquire(const unsigned int* p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(unsigned int* p, unsigned int v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#endif
+
+IoRing::IoRing() {
+	m_fd = -1;
+	m_entries = 0;
+	m_queued = 0;
+	m_inFlight = 0;
+	m_registered = false;
+	m_sqRing = m_cqRing = NULL;
+	m_sqRingSize = m_cqRingSize = m_sqesSize = 0;
+	m_sqes = NULL;
+	m_sqHead = m_sqTail = m_sqMask = m_sqArray = NULL;
+	m_cqHead = m_cqTail = m_cqMask = NULL;
+	m_cqes = NULL;
+}
+
+#if TGA_IO_URING
+// Destructor
+//
+// Requests still in flight are waited for, their buffers belong to
+// the caller and must not be written by the kernel afterwards.
+IoRing::~IoRing() {
+	if (m_fd < 0) return;
+	uint64_t tag;
+	int result;
+	while (outstanding() > 0 && waitCompletion(&tag, &result)) {}
+	unregisterBuffers();
+	if (m_sqes != NULL) munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != NULL && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+	if (m_sqRing != NULL) munmap(m_sqRing, m_sqRingSize);
+	close(m_fd);
+}
+
+// init
+//
+// Creates the ring and maps its queues. Fails on kernels without
+// io_uring or where it is blocked (e.g. by a seccomp profile).
+//
+// @param entries - submission queue size, rounded up by the kernel
+bool IoRing::init(unsigned int entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	m_fd = ringSetup(entries, &p);
+	if (m_fd < 0) return false;
+	m_entries = p.sq_entries;
+
+	m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	// newer kernels map both rings with one mmap
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) m_sqRingSize = m_cqRingSize = (m_sqRingSize > m_cqRingSize) ? m_sqRingSize : m_cqRingSize;
+
+	void* sq = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	m_sqRing = sq;
+	if (single) m_cqRing = sq;
+	else {
+		void* cq = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			munmap(m_sqRing, m_sqRingSize);
+			m_sqRing = NULL;
+			close(m_fd);
+			m_fd = -1;
+			return false;
+		}
+		m_cqRing = cq;
+	}
+	m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+		munmap(m_sqRing, m_sqRingSize);
+		m_sqRing = m_cqRing = NULL;
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+	char* sqBase = static_cast<char*>(m_sqRing);
+	m_sqHead = reinterpret_cast<unsigned int*>(sqBase + p.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned int*>(sqBase + p.sq_off.tail);
+	m_sqMask = reinterpret_cast<unsigned int*>(sqBase + p.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned int*>(sqBase + p.sq_off.array);
+	char* cqBase = static_cast<char*>(m_cqRing);
+	m_cqHead = reinterpret_cast<unsigned int*>(cqBase + p.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned int*>(cqBase + p.cq_off.tail);
+	m_cqMask = reinterpret_cast<unsigned int*>(cqBase + p.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe*>(cqBase + p.cq_off.cqes);
+	return true;
+}
+
+// registerBuffers
+//
+// Pins buffers so reads into them (queueRead with fixedIndex, the
+// position in this array) skip the per request page lookups. Only
+// one set is registered at a time. Fails e.g. when the buffers
+// exceed RLIMIT_MEMLOCK, reads then simply go unregistered.
+bool IoRing::registerBuffers(const IoVec* buffers, unsigned int count) {
+	if (m_fd < 0 || count == 0) return false;
+	unregisterBuffers();
+	m_registered = ringRegister(m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	return m_registered;
+}
+
+// unregisterBuffers
+//
+// Call only with no fixed reads outstanding.
+void IoRing::unregisterBuffers() {
+	if (!m_registered) return;
+	ringRegister(m_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	m_registered = false;
+}
+
+// nextEntry
+//
+// Free submission entry, submitting what is queued if the queue is
+// full. NULL if the kernel does not take any of it.
+struct io_uring_sqe* IoRing::nextEntry() {
+	if (m_fd < 0) return NULL;
+	unsigned int tail = *m_sqTail;
+	if (tail - loadAcquire(m_sqHead) >= m_entries) {
+		if (submit() <= 0) return NULL;
+	}
+	unsigned int idx = tail & *m_sqMask;
+	struct io_uring_sqe* sqe = &m_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqArray[idx] = idx;
+	return sqe;
+}
+
+// queueRead
+//
+// Queues a read of up to 'length' bytes at 'offset'. Like pread it
+// may complete short, the result is the number of bytes read.
+//
+// @param fixedIndex - index of the registered buffer holding buf,
+//                     -1 for an unregistered buffer
+bool IoRing::queueRead(int fd, void* buf, size_t length, uint64_t offset, uint64_t tag, int fixedIndex) {
+	struct io_uring_sqe* sqe = nextEntry();
+	if (sqe == NULL) return false;
+	sqe->opcode = (fixedIndex >= 0 && m_registered) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buf);
+	sqe->len = static_cast<unsigned int>((length < MAX_REQUEST_BYTES) ? length : MAX_REQUEST_BYTES);
+	sqe->off = offset;
+	if (sqe->opcode == IORING_OP_READ_FIXED) sqe->buf_index = static_cast<uint16_t>(fixedIndex);
+	sqe->user_data = tag;
+	storeRelease(m_sqTail, *m_sqTail + 1);
+	m_queued++;
+	return true;
+}
+
+// queueWritev
+//
+// Queues one vectored write of 'count' buffers at 'offset'. The iov
+// array and the buffers must stay valid until the completion.
+bool IoRing::queueWritev(int fd, const IoVec* iov, unsigned int count, uint64_t offset, uint64_t tag) {
+	struct io_uring_sqe* sqe = nextEntry();
+	if (sqe == NULL) return false;
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(iov);
+	sqe->len = count;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	storeRelease(m_sqTail, *m_sqTail + 1);
+	m_queued++;
+	return true;
+}
+
+// submit
+//
+// Hands every queued request to the kernel with one io_uring_enter.
+//
+// @return number of requests submitted, -1 on error
+int IoRing::submit() {
+	if (m_fd < 0) return -1;
+	if (m_queued == 0) return 0;
+	int submitted;
+	do {
+		submitted = ringEnter(m_fd, m_queued, 0, 0);
+	} while (submitted < 0 && errno == EINTR);
+	if (submitted < 0) return -1;
+	m_queued -= submitted;
+	m_inFlight += submitted;
+	return submitted;
+}
+
+// waitCompletion
+//
+// Reaps the next completion, submitting queued requests and
+// blocking until one finishes if none is ready.
+//
+// @param tag - receives the tag the request was queued with
+// @param result - bytes transferred, or -errno
+//
+// @return false if nothing is outstanding
+bool IoRing::waitCompletion(uint64_t* tag, int* result) {
+	if (m_fd < 0) return false;
+	for (;;) {
+		unsigned int head = *m_cqHead;
+		if (head != loadAcquire(m_cqTail)) {
+			struct io_uring_cqe* cqe = &m_cqes[head & *m_cqMask];
+			*tag = cqe->user_data;
+			*result = cqe->res;
+			storeRelease(m_cqHead, head + 1);
+			m_inFlight--;
+			return true;
+		}
+		if (outstanding() == 0) return false;
+		int submitted = ringEnter(m_fd, m_queued, 1, IORING_ENTER_GETEVENTS);
+		if (submitted < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		m_queued -= submitted;
+		m_inFlight += submitted;
+	}
+}
+
+#else
+// io_uring is not built in, init fails and callers use stdio
+
+IoRing::~IoRing() {}
+bool IoRing::init(unsigned int entries) { (void)entries; return false; }
+bool IoRing::registerBuffers(const IoVec* buffers, unsigned int count) { (void)buffers; (void)count; return false; }
+void IoRing::unregisterBuffers() {}
+bool IoRing::queueRead(int, void*, size_t, uint64_t, uint64_t, int) { return false; }
+bool IoRing::queueWritev(int, const IoVec*, unsigned int, uint64_t, uint64_t) { return false; }
+int IoRing::submit() { return -1; }
+bool IoRing::waitCompletion(uint64_t*, int*) { return false; }
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Asynchronous file I/O through Linux io_uring, driven by the raw
+// io_uring_setup / io_uring_enter / io_uring_register syscalls so
+// no liburing is needed. Built on Linux when the kernel headers
+// provide <linux/io_uring.h>; compile with TGA_IO_URING=0 to leave
+// it out. Without it IoRing::init fails and callers stay on stdio.
+#ifndef TGA_IO_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TGA_IO_URING 1
+#endif
+#endif
+#endif
+#ifndef TGA_IO_URING
+#define TGA_IO_URING 0
+#endif
+
+#ifndef _WIN32
+#include <sys/uio.h>
+typedef struct iovec IoVec;
+#else
+typedef struct {
+	void* iov_base;
+	size_t iov_len;
+} IoVec;
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// writeVectored
+//
+// Writes count buffers to a stream opened for writing, in order. On
+// POSIX systems this is one writev (repeated only if the kernel takes
+// less), elsewhere one fwrite per buffer. Whatever the stream still
+// buffers is flushed first.
+//
+// @return false if not every byte could be written
+bool writeVectored(FILE* filePtr, const IoVec* iov, unsigned int count);
+
+// class IoRing
+//
+// One submission / completion queue pair. Requests are queued with
+// queueRead / queueWritev, handed to the kernel together by submit
+// and reaped one by one with waitCompletion. The tag given with a
+// request comes back with its completion. Not thread safe, every
+// thread driving I/O owns its ring.
+class IoRing {
+public:
+	IoRing();
+	~IoRing();
+
+	bool init(unsigned int entries);
+	bool registerBuffers(const IoVec* buffers, unsigned int count);
+	void unregisterBuffers();
+	bool queueRead(int fd, void* buf, size_t length, uint64_t offset, uint64_t tag, int fixedIndex = -1);
+	bool queueWritev(int fd, const IoVec* iov, unsigned int count, uint64_t offset, uint64_t tag);
+	int submit();
+	bool waitCompletion(uint64_t* tag, int* result);
+	// requests queued or submitted whose completion was not reaped yet
+	unsigned int outstanding() const { return m_queued + m_inFlight; }
+
+private:
+	struct io_uring_sqe* nextEntry();
+
+	int m_fd;
+	unsigned int m_entries;
+	unsigned int m_queued;
+	unsigned int m_inFlight;
+	bool m_registered;
+
+	void* m_sqRing;
+	size_t m_sqRingSize;
+	void* m_cqRing;
+	size_t m_cqRingSize;
+	struct io_uring_sqe* m_sqes;
+	size_t m_sqesSize;
+
+	unsigned int* m_sqHead;
+	unsigned int* m_sqTail;
+	unsigned int* m_sqMask;
+	unsigned int* m_sqArray;
+	unsigned int* m_cqHead;
+	unsigned int* m_cqTail;
+	unsigned int* m_cqMask;
+	struct io_uring_cqe* m_cqes;
+};
@@ -0,0 +1,537 @@
+#include "BatchProcessor.h"
+#include "AsyncIO.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <stdlib.h>
+#if TGA_IO_URING
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// files read, and outputs written, per io_uring batch
+#define IO_BATCH 4
+// a read batch is closed early once its files reach this size, large
+// images are read one at a time rather than all held at once
+#define IO_BATCH_BYTES (64 << 20)
+
+typedef std::chrono::steady_clock Clock;
+
+static double msSince(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Constructor
+//
+// @param queueCapacity - max images waiting between two stages, 
+//        bounds the memory held by decoded images in flight
+BatchProcessor::BatchProcessor(unsigned int queueCapacity)
+	: m_loaded(queueCapacity), m_resized(queueCapacity) {
+	m_load = m_resize = m_save = StageStats{ 0, 0.0, 0.0, 0.0 };
+	m_failed = 0;
+	m_resampleThreads = 1;
+	m_compression = UNCOMPRESSED;
+	m_mapFiles = false;
+	m_boxFilter = true;
+	m_filter = BILINEAR;
+	m_kernel = SEPARABLE;
+	m_tileWidth = 0;
+	m_tileHeight = 0;
+	m_padded = false;
+	m_asyncIO = false;
+	m_cache = NULL;
+	m_wallMs = 0.0;
+}
+
+BatchProcessor::~BatchProcessor() {
+	for (auto job : m_jobs) delete job;
+}
+
+// parseScale
+//
+// A scale factor as the command line takes it, the whole word has to
+// be a number > 0.
+static bool parseScale(const std::string& word, float* scale) {
+	char* end;
+	float value = strtof(word.c_str(), &end);
+	if (end == word.c_str() || *end != '\0' || !(value > 0)) return false;
+	*scale = value;
+	return true;
+}
+
+// addManifest
+//
+// Reads jobs from a text file, one per line:
+//   input.tga output.tga [scalex [scaley]]
+// Empty lines and lines starting with '#' are skipped, a '#' after
+// the fields starts a comment. Missing scale factors fall back to the
+// ones given here; lines with scale factors that are not numbers > 0,
+// or with more fields, are reported and skipped.
+//
+// @return false if the manifest cannot be opened
+bool BatchProcessor::addManifest(const char* manifest, float scalex, float scaley) {
+	std::ifstream in(manifest);
+	if (!in) {
+		printf("Cannot open manifest \"%s\"\n", manifest);
+		return false;
+	}
+	std::string line;
+	int lineNo = 0;
+	while (std::getline(in, line)) {
+		lineNo++;
+		std::istringstream fields(line);
+		std::string input, output, word;
+		if (!(fields >> input) || input[0] == '#' || !(fields >> output))
+			continue;
+		// up to two scale factors, then only a comment may follow
+		std::vector<std::string> scales;
+		while (fields >> word && word[0] != '#') scales.push_back(word);
+		float sx = scalex, sy = scaley;
+		bool valid = scales.size() <= 2;
+		if (valid && scales.size() >= 1) {
+			valid = parseScale(scales[0], &sx);
+			sy = sx;
+		}
+		if (valid && scales.size() == 2) valid = parseScale(scales[1], &sy);
+		if (!valid) {
+			printf("%s:%d: expected input output [scalex [scaley]] with scale factors > 0, line skipped\n",
+				manifest, lineNo);
+			continue;
+		}
+		BatchJob* job = new BatchJob();
+		job->input = input;
+		job->output = output;
+		job->scalex = sx;
+		job->scaley = sy;
+		m_jobs.push_back(job);
+	}
+	return true;
+}
+
+// addDirectory
+//
+// Adds every .tga file of inDir as a job writing to outDir under 
+// the same name. outDir is created if needed.
+//
+// @return false if inDir is not a directory
+bool BatchProcessor::addDirectory(const char* inDir, const char* outDir, float scalex, float scaley) {
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	if (!fs::is_directory(inDir, ec)) {
+		printf("\"%s\" is not a directory\n", inDir);
+		return false;
+	}
+	fs::create_directories(outDir, ec);
+
+	std::vector<fs::path> files;
+	for (auto const& entry : fs::directory_iterator(inDir, ec)) {
+		std::string ext = entry.path().extension().string();
+		if (entry.is_regular_file() && (ext == ".tga" || ext == ".TGA"))
+			files.push_back(entry.path());
+	}
+	std::sort(files.begin(), files.end());
+	for (auto const& f : files) {
+		BatchJob* job = new BatchJob();
+		job->input = f.string();
+		job->output = (fs::path(outDir) / f.filename()).string();
+		job->scalex = scalex;
+		job->scaley = scaley;
+		m_jobs.push_back(job);
+	}
+	return true;
+}
+
+// run
+//
+// Starts the three stages and waits until every job went through.
+//
+// @return false if any job failed
+bool BatchProcessor::run() {
+	TargaHandler loadHandler, resizeHandler, saveHandler;
+	resizeHandler.setThreadCount(m_resampleThreads);
+	resizeHandler.setBoxFilter(m_boxFilter);
+	resizeHandler.setFilter(m_filter);
+	resizeHandler.setKernel(m_kernel);
+	resizeHandler.setTileSize(m_tileWidth, m_tileHeight);
+	loadHandler.setMemoryMapping(m_mapFiles);
+	loadHandler.setPaddedLayout(m_padded);
+
+	Clock::time_point start = Clock::now();
+	std::thread loader(m_asyncIO ? &BatchProcessor::loadStageAsync : &BatchProcessor::loadStage, 
+	                   this, &loadHandler);
+	std::thread resizer(&BatchProcessor::resizeStage, this, &resizeHandler);
+	std::thread saver(m_asyncIO ? &BatchProcessor::saveStageAsync : &BatchProcessor::saveStage, 
+	                  this, &saveHandler);
+	loader.join();
+	resizer.join();
+	saver.join();
+	m_wallMs = msSince(start);
+	// pool counts as of the end of the run, for printReport
+	getPoolStats(m_poolStats);
+	return m_failed == 0;
+}
+
+// loadStage
+//
+// Decodes inputs in order and hands them to the resize stage.
+// Failed loads are counted and dropped here.
+void BatchProcessor::loadStage(TargaHandler* handler) {
+	for (auto job : m_jobs) {
+		if (fromCache(job)) continue;
+		Clock::time_point start = Clock::now();
+		job->ok = handler->loadTGA(job->input.c_str(), &job->image);
+		m_load.busyMs += msSince(start);
+		if (!job->ok) {
+			printf("Skipping \"%s\"\n", job->input.c_str());
+			m_failed++;
+			continue;
+		}
+		m_load.items++;
+		m_load.megaPixels += job->image.width * job->image.height / 1e6;
+		m_load.bytes += job->image.imageSize;
+		m_loaded.push(job);
+	}
+	m_loaded.close();
+}
+
+// fromCache
+//
+// Looks the job up in the cache, a hit places the stored output and
+// the job needs no further stage. Otherwise its key is kept so the
+// save stage can add the result.
+bool BatchProcessor::fromCache(BatchJob* job) {
+	if (m_cache == NULL) return false;
+	job->cacheKey = m_cache->key(job->input.c_str(), job->scalex, job->scaley, 
+		m_filter, m_kernel, m_boxFilter, m_compression);
+	job->ok = m_cache->fetch(job->cacheKey, job->output.c_str());
+	return job->ok;
+}
+
+// resizeStage
+void BatchProcessor::resizeStage(TargaHandler* handler) {
+	BatchJob* job;
+	while (m_loaded.pop(job)) {
+		Clock::time_point start = Clock::now();
+		handler->ResampleBillinear(&job->image, job->scalex, job->scaley);
+		m_resize.busyMs += msSince(start);
+		m_resize.items++;
+		m_resize.megaPixels += job->image.width * job->image.height / 1e6;
+		m_resize.bytes += job->image.imageSize;
+		m_resized.push(job);
+	}
+	m_resized.close();
+}
+
+// saveStage
+//
+// Writes results, saveTGA returns the image memory to its pool.
+void BatchProcessor::saveStage(TargaHandler* handler) {
+	BatchJob* job;
+	while (m_resized.pop(job)) {
+		int bytes = job->image.imageSize;
+		double mp = job->image.width * job->image.height / 1e6;
+		Clock::time_point start = Clock::now();
+		job->ok = handler->saveTGA(job->output.c_str(), &job->image, m_compression);
+		m_save.busyMs += msSince(start);
+		if (!job->ok) {
+			printf("Could not save \"%s\"\n", job->output.c_str());
+			m_failed++;
+			continue;
+		}
+		if (m_cache != NULL) m_cache->store(job->cacheKey, job->output.c_str());
+		m_save.items++;
+		m_save.megaPixels += mp;
+		m_save.bytes += bytes;
+	}
+}
+
+#if TGA_IO_URING
+// ReadSlot
+//
+// One file of a loadStageAsync batch.
+typedef struct {
+	BatchJob* job;
+	int fd;
+	size_t fileSize;
+	unsigned char header[18];
+	PendingLoad load;
+	size_t done;
+	int fixedIndex;
+	bool ok;
+	bool cached;
+} ReadSlot;
+
+// loadStageAsync
+//
+// loadStage over io_uring. IO_BATCH files at a time are opened and 
+// their headers read with one submission, then their pixel or packet
+// data with a second one, straight into the pool buffers beginLoad 
+// handed out, registered with the ring for the duration of the read.
+// Falls back to loadStage if no ring can be created.
+void BatchProcessor::loadStageAsync(TargaHandler* handler) {
+	IoRing ring;
+	if (!ring.init(IO_BATCH)) {
+		printf("io_uring unavailable, reading with stdio\n");
+		loadStage(handler);
+		return;
+	}
+	uint64_t tag;
+	int result;
+	for (size_t first = 0; first < m_jobs.size(); ) {
+		ReadSlot slots[IO_BATCH];
+		Clock::time_point start = Clock::now();
+
+		// the headers of the whole batch, which ends once its files 
+		// add up to IO_BATCH_BYTES
+		unsigned int n = 0;
+		size_t batchBytes = 0;
+		while (n < IO_BATCH && first + n < m_jobs.size() && batchBytes < IO_BATCH_BYTES) {
+			ReadSlot& r = slots[n];
+			r.job = m_jobs[first + n];
+			r.cached = fromCache(r.job);
+			r.fd = -1;
+			r.ok = false;
+			if (r.cached) {
+				n++;
+				continue;
+			}
+			r.done = 0;
+			r.fixedIndex = -1;
+			r.fd = open(r.job->input.c_str(), O_RDONLY);
+			struct stat st;
+			if (r.fd < 0 || fstat(r.fd, &st) != 0) {
+				printf("Cannot open file specified\n");
+				n++;
+				continue;
+			}
+			r.fileSize = static_cast<size_t>(st.st_size);
+			batchBytes += r.fileSize;
+			ring.queueRead(r.fd, r.header, 18, 0, n);
+			n++;
+		}
+		first += n;
+		{
+			METRICS_SCOPE(STAGE_HEADER);
+			while (ring.outstanding() > 0 && ring.waitCompletion(&tag, &result)) {
+				slots[tag].ok = (result == 18);
+				if (!slots[tag].ok) printf("Invalid data format\n");
+			}
+		}
+
+		// then the data, into registered pool buffers if possible
+		IoVec buffers[IO_BATCH];
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			ReadSlot& r = slots[i];
+			if (r.ok) r.ok = handler->beginLoad(r.header, r.fileSize, &r.job->image, &r.load);
+			if (r.ok && r.load.length > 0) {
+				r.fixedIndex = count;
+				buffers[count].iov_base = r.load.buffer;
+				buffers[count].iov_len = r.load.length;
+				count++;
+			}
+		}
+		bool fixed = ring.registerBuffers(buffers, count);
+		for (unsigned int i = 0; i < n; i++) {
+			ReadSlot& r = slots[i];
+			if (r.ok && r.load.length > 0)
+				ring.queueRead(r.fd, r.load.buffer, r.load.length, r.load.offset, i, fixed ? r.fixedIndex : -1);
+		}
+		{
+			METRICS_SCOPE(STAGE_READ);
+			while (ring.outstanding() > 0 && ring.waitCompletion(&tag, &result)) {
+				ReadSlot& r = slots[tag];
+				// reads may come back short, the rest is asked for again;
+				// errors and the end of file leave the data truncated
+				if (result > 0) {
+					r.done += result;
+					if (r.done < r.load.length)
+						ring.queueRead(r.fd, r.load.buffer + r.done, r.load.length - r.done,
+						               r.load.offset + r.done, tag, fixed ? r.fixedIndex : -1);
+				}
+			}
+		}
+		ring.unregisterBuffers();
+
+		for (unsigned int i = 0; i < n; i++) {
+			ReadSlot& r = slots[i];
+			if (r.fd >= 0) close(r.fd);
+			if (r.ok) r.ok = handler->finishLoad(&r.job->image, &r.load, r.done);
+			if (!r.cached) r.job->ok = r.ok;
+		}
+		m_load.busyMs += msSince(start);
+
+		for (unsigned int i = 0; i < n; i++) {
+			BatchJob* job = slots[i].job;
+			if (slots[i].cached) continue;
+			if (!job->ok) {
+				printf("Skipping \"%s\"\n", job->input.c_str());
+				m_failed++;
+				continue;
+			}
+			m_load.items++;
+			m_load.megaPixels += job->image.width * job->image.height / 1e6;
+			m_load.bytes += job->image.imageSize;
+			m_loaded.push(job);
+		}
+	}
+	m_loaded.close();
+}
+
+// WriteSlot
+//
+// One output of saveStageAsync in flight.
+typedef struct {
+	BatchJob* job;
+	int fd;
+	EncodedImage encoded;
+	std::vector<IoVec> iov;
+	double megaPixels;
+	int bytes;
+	bool busy;
+} WriteSlot;
+
+// saveStageAsync
+//
+// saveStage over io_uring. Every result is encoded and its header 
+// and data submitted as one vectored write, without waiting for it;
+// up to IO_BATCH writes are in flight while the next results come
+// in. Images are released once their write completed.
+void BatchProcessor::saveStageAsync(TargaHandler* handler) {
+	IoRing ring;
+	if (!ring.init(IO_BATCH)) {
+		printf("io_uring unavailable, writing with stdio\n");
+		saveStage(handler);
+		return;
+	}
+	WriteSlot slots[IO_BATCH];
+	for (auto& w : slots) w.busy = false;
+	unsigned int inFlight = 0;
+
+	// reaps one write, a short one is finished with pwrite
+	auto complete = [&]() {
+		METRICS_SCOPE(STAGE_WRITE);
+		uint64_t tag;
+		int result;
+		if (!ring.waitCompletion(&tag, &result)) return;
+		WriteSlot& w = slots[tag];
+		const size_t total = 18 + w.encoded.length;
+		size_t written = (result > 0) ? static_cast<size_t>(result) : 0;
+		bool ok = result >= 0;
+		size_t at = 0;
+		for (size_t i = 0; ok && i < w.iov.size(); at += w.iov[i].iov_len, i++) {
+			const size_t end = at + w.iov[i].iov_len;
+			while (ok && written < end) {
+				const char* from = static_cast<const char*>(w.iov[i].iov_base) + (written - at);
+				ssize_t n = pwrite(w.fd, from, end - written, static_cast<off_t>(written));
+				if (n <= 0) ok = false;
+				else written += static_cast<size_t>(n);
+			}
+		}
+		close(w.fd);
+		handler->releaseEncoded(&w.encoded);
+		handler->freeImage(&w.job->image);
+		w.job->ok = ok;
+		w.busy = false;
+		inFlight--;
+		if (!ok) {
+			printf("Could not save \"%s\"\n", w.job->output.c_str());
+			m_failed++;
+			return;
+		}
+		METRICS_ADD(BYTES_WRITTEN, total);
+		if (m_cache != NULL) m_cache->store(w.job->cacheKey, w.job->output.c_str());
+		m_save.items++;
+		m_save.megaPixels += w.megaPixels;
+		m_save.bytes += w.bytes;
+	};
+
+	BatchJob* job;
+	while (m_resized.pop(job)) {
+		Clock::time_point start = Clock::now();
+		if (inFlight == IO_BATCH) complete();
+		unsigned int idx = 0;
+		while (slots[idx].busy) idx++;
+		WriteSlot& w = slots[idx];
+		w.job = job;
+		w.bytes = job->image.imageSize;
+		w.megaPixels = job->image.width * job->image.height / 1e6;
+
+		bool ok = handler->encodeTGA(&job->image, m_compression, &w.encoded);
+		if (ok) {
+			w.fd = open(job->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (w.fd < 0) printf("Cannot open file specified\n");
+			ok = w.fd >= 0;
+		}
+		if (ok) {
+			// the header, then one buffer per encoded chunk
+			w.iov.resize(1 + w.encoded.parts.size());
+			w.iov[0].iov_base = w.encoded.header;
+			w.iov[0].iov_len = 18;
+			std::copy(w.encoded.parts.begin(), w.encoded.parts.end(), w.iov.begin() + 1);
+			ok = ring.queueWritev(w.fd, w.iov.data(), static_cast<unsigned int>(w.iov.size()), 0, idx);
+			if (ok) ring.submit();
+			else close(w.fd);
+		}
+		if (ok) {
+			w.busy = true;
+			inFlight++;
+		}
+		else {
+			handler->releaseEncoded(&w.encoded);
+			handler->freeImage(&job->image);
+			job->ok = false;
+			printf("Could not save \"%s\"\n", job->output.c_str());
+			m_failed++;
+		}
+		m_save.busyMs += msSince(start);
+	}
+	Clock::time_point start = Clock::now();
+	while (inFlight > 0) complete();
+	m_save.busyMs += msSince(start);
+}
+#else
+// io_uring is not built in (see AsyncIO.h), both stages stay on stdio
+void BatchProcessor::loadStageAsync(TargaHandler* handler) {
+	loadStage(handler);
+}
+
+void BatchProcessor::saveStageAsync(TargaHandler* handler) {
+	saveStage(handler);
+}
+#endif
+
+// printReport
+//
+// Per stage throughput over the time the stage was busy, plus how
+// full the queues between the stages were on average.
+void BatchProcessor::printReport() {
+	printf("Batch: %u jobs, %u failed, %.1f ms wall\n", 
+		static_cast<unsigned int>(m_jobs.size()), m_failed.load(), m_wallMs);
+	const char* names[3] = { "load", "resize", "save" };
+	StageStats* stages[3] = { &m_load, &m_resize, &m_save };
+	for (int i = 0; i < 3; i++) {
+		StageStats* s = stages[i];
+		double sec = s->busyMs / 1000.0;
+		printf("  %-6s %5u items %9.1f ms busy (%3.0f%%) %8.1f img/s %8.1f MP/s %8.1f MB/s\n",
+			names[i], s->items, s->busyMs, m_wallMs > 0 ? 100.0 * s->busyMs / m_wallMs : 0.0,
+			sec > 0 ? s->items / sec : 0.0, sec > 0 ? s->megaPixels / sec : 0.0,
+			sec > 0 ? s->bytes / 1e6 / sec : 0.0);
+	}
+	printf("  load->resize queue: avg %.2f max %u of %u, producer waits %u, consumer waits %u\n",
+		m_loaded.averageOccupancy(), (unsigned int)m_loaded.maxOccupancy(), (unsigned int)m_loaded.capacity(),
+		(unsigned int)m_loaded.fullWaits(), (unsigned int)m_loaded.emptyWaits());
+	printf("  resize->save queue: avg %.2f max %u of %u, producer waits %u, consumer waits %u\n",
+		m_resized.averageOccupancy(), (unsigned int)m_resized.maxOccupancy(), (unsigned int)m_resized.capacity(),
+		(unsigned int)m_resized.fullWaits(), (unsigned int)m_resized.emptyWaits());
+	for (auto const& p : m_poolStats) {
+		unsigned int total = p.hits + p.misses;
+		printf("  pool class %10u bytes: %6u hits %6u misses (%3.0f%% reuse)\n",
+			p.classSize, p.hits, p.misses, total ? 100.0 * p.hits / total : 0.0);
+	}
+}
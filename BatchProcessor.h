@@ -0,0 +1,94 @@
+#pragma once
+#include "targaHandler.h"
+#include "BoundedQueue.h"
+#include "ResultCache.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+// BatchJob
+//
+// One input/output pair travelling through the pipeline. 
+typedef struct {
+	std::string input;
+	std::string output;
+	float scalex;
+	float scaley;
+	Image image;
+	bool ok;
+	std::string cacheKey;
+} BatchJob;
+
+// StageStats
+//
+// Work done by one pipeline stage during a run.
+typedef struct {
+	unsigned int items;
+	double busyMs;
+	double megaPixels;
+	double bytes;
+} StageStats;
+
+// class BatchProcessor
+//
+// Runs loadTGA -> ResampleBillinear -> saveTGA over many files as 
+// three overlapping stages, each on its own thread with its own 
+// TargaHandler, connected by bounded queues. While one image is being
+// resized the next is read from disk and the previous one written.
+// With setAsyncIO the load and save stages keep several reads and
+// writes in flight through io_uring instead of blocking on each.
+class BatchProcessor {
+public:
+	BatchProcessor(unsigned int queueCapacity = 4);
+	~BatchProcessor();
+
+	bool addManifest(const char* manifest, float scalex, float scaley);
+	bool addDirectory(const char* inDir, const char* outDir, float scalex, float scaley);
+	void setThreadCount(unsigned int threads) { m_resampleThreads = threads; }
+	void setCompression(COMPRESSION comp) { m_compression = comp; }
+	void setMemoryMapping(bool enable) { m_mapFiles = enable; }
+	void setBoxFilter(bool enable) { m_boxFilter = enable; }
+	void setFilter(FILTER filter) { m_filter = filter; }
+	void setKernel(KERNEL kernel) { m_kernel = kernel; }
+	void setTileSize(int width, int height) { m_tileWidth = width; m_tileHeight = height; }
+	void setPaddedLayout(bool enable) { m_padded = enable; }
+	// read and write through io_uring where available, see AsyncIO.h
+	void setAsyncIO(bool enable) { m_asyncIO = enable; }
+	// jobs found in the cache are skipped, new results are added to it
+	void setCache(ResultCache* cache) { m_cache = cache; }
+
+	bool run();
+	void printReport();
+	// pool statistics as captured at the end of run()
+	const std::vector<PoolStats>& poolStats() const { return m_poolStats; }
+
+private:
+	void loadStage(TargaHandler* handler);
+	void resizeStage(TargaHandler* handler);
+	void saveStage(TargaHandler* handler);
+	void loadStageAsync(TargaHandler* handler);
+	void saveStageAsync(TargaHandler* handler);
+	bool fromCache(BatchJob* job);
+
+	std::vector<BatchJob*> m_jobs;
+	BoundedQueue<BatchJob*> m_loaded;
+	BoundedQueue<BatchJob*> m_resized;
+
+	StageStats m_load;
+	StageStats m_resize;
+	StageStats m_save;
+	std::vector<PoolStats> m_poolStats;
+	std::atomic<unsigned int> m_failed;
+	unsigned int m_resampleThreads;
+	COMPRESSION m_compression;
+	bool m_mapFiles;
+	bool m_boxFilter;
+	FILTER m_filter;
+	KERNEL m_kernel;
+	int m_tileWidth;
+	int m_tileHeight;
+	bool m_padded;
+	bool m_asyncIO;
+	ResultCache* m_cache;
+	double m_wallMs;
+};
@@ -0,0 +1,180 @@
+#include "Benchmark.h"
+#include <chrono>
+#include <filesystem>
+
+typedef std::chrono::steady_clock Clock;
+
+const char* contentName[] = { "flat", "gradient", "noise" };
+
+// generateImage
+void generateImage(Image* img, int width, int height, int bpp, CONTENT content) {
+	img->width = width;
+	img->height = height;
+	img->bpp = bpp;
+	img->imageSize = width * height * bpp;
+	img->mapBase = NULL;
+	img->mapLength = 0;
+	img->padded = false;
+	img->data = newMemory<unsigned char>(img->imageSize, 0);
+
+	uint32_t state = 2463534242u;
+	for (int y = 0; y < height; y++) {
+		unsigned char* row = img->data + static_cast<size_t>(y) * width * bpp;
+		for (int x = 0; x < width; x++) {
+			unsigned char* p = row + x * bpp;
+			if (content == FLAT) {
+				p[0] = 40; p[1] = 120; p[2] = 200;
+			}
+			else if (content == GRADIENT) {
+				p[0] = sc_uchar(x * 255 / width);
+				p[1] = sc_uchar(y * 255 / height);
+				p[2] = sc_uchar((x + y) * 127 / (width + height));
+			}
+			else {
+				// xorshift32, cheap and deterministic between runs
+				state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+				p[0] = sc_uchar(state); p[1] = sc_uchar(state >> 8); p[2] = sc_uchar(state >> 16);
+			}
+			if (bpp == 4) p[3] = (content == NOISE) ? sc_uchar(state >> 24) : 255;
+		}
+	}
+}
+
+// Result
+//
+// One timed operation, MP/s are source pixels for every operation.
+typedef struct {
+	const char* op;
+	int width;
+	int height;
+	int bpp;
+	CONTENT content;
+	float scale;
+	double ms;
+	double bytes;
+} Result;
+
+static void report(FILE* out, const Result& r) {
+	double sec = r.ms / 1000.0;
+	double mp = static_cast<double>(r.width) * r.height / 1e6;
+	printf("  %-17s %5dx%-5d %2dbpp %-8s %5.3f %10.2f ms %9.1f MP/s %9.1f MB/s\n",
+		r.op, r.width, r.height, r.bpp * 8, contentName[r.content], r.scale, r.ms,
+		sec > 0 ? mp / sec : 0.0, sec > 0 ? r.bytes / 1e6 / sec : 0.0);
+	fprintf(out, "%s,%d,%d,%d,%s,%.3f,%.4f,%.0f,%.3f,%.3f\n",
+		r.op, r.width, r.height, r.bpp * 8, contentName[r.content], r.scale, r.ms, r.bytes,
+		sec > 0 ? mp / sec : 0.0, sec > 0 ? r.bytes / 1e6 / sec : 0.0);
+	fflush(out);
+}
+
+static double msSince(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// runBenchmark
+bool runBenchmark(const char* resultFile, int maxSize, unsigned int threads) {
+	namespace fs = std::filesystem;
+	const int sizes[] = { 128, 512, 1024, 2048, 4096, 8192, 16384 };
+	const float scales[] = { 0.5f, 0.25f, 0.33f, 1.5f };
+	const int bpps[] = { 3, 4 };
+
+	FILE* out;
+	fopen_s(&out, resultFile, "w");
+	if (out == NULL) {
+		printf("Cannot open file specified\n");
+		return false;
+	}
+	fprintf(out, "op,width,height,bpp,content,scale,ms,bytes,mpix_per_s,mb_per_s\n");
+
+	std::error_code ec;
+	fs::path dir = fs::temp_directory_path(ec) / "tga_bench";
+	fs::create_directories(dir, ec);
+	std::string rawFile = (dir / "bench_uc.tga").string();
+	std::string rleFile = (dir / "bench_rle.tga").string();
+
+	TargaHandler handler;
+	handler.setVerbose(false);
+	handler.setThreadCount(threads);
+	// "resample" rows time the bilinear kernel at every scale, the box
+	// filter would take over at 0.5 and 0.25
+	handler.setBoxFilter(false);
+	bool success = true;
+
+	for (int size : sizes) {
+		if (size > maxSize) break;
+		// repeat small cases and keep the best time, one run at 16k
+		int reps = static_cast<int>(16 * 1024 * 1024 / (static_cast<double>(size) * size));
+		if (reps < 1) reps = 1;
+		if (reps > 5) reps = 5;
+
+		for (int bpp : bpps) {
+			for (int c = FLAT; c <= NOISE && success; c++) {
+				CONTENT content = static_cast<CONTENT>(c);
+				Result r = { "", size, size, bpp, content, 1.0f, 0.0, 0.0 };
+				Image img;
+
+				// encode / write
+				const char* saveOps[2] = { "save_uncompressed", "save_rle" };
+				const std::string* saveFiles[2] = { &rawFile, &rleFile };
+				for (int comp = UNCOMPRESSED; comp <= RLE && success; comp++) {
+					double best = -1.0;
+					for (int i = 0; i < reps && success; i++) {
+						generateImage(&img, size, size, bpp, content);
+						Clock::time_point start = Clock::now();
+						success = handler.saveTGA(saveFiles[comp]->c_str(), &img, static_cast<COMPRESSION>(comp));
+						double ms = msSince(start);
+						if (best < 0 || ms < best) best = ms;
+					}
+					r.op = saveOps[comp];
+					r.ms = best;
+					r.bytes = static_cast<double>(fs::file_size(*saveFiles[comp], ec));
+					if (success) report(out, r);
+				}
+				if (!success) break;
+
+				// read / decode
+				const char* loadOps[2] = { "load_uncompressed", "load_rle" };
+				for (int comp = UNCOMPRESSED; comp <= RLE && success; comp++) {
+					double best = -1.0;
+					for (int i = 0; i < reps && success; i++) {
+						Clock::time_point start = Clock::now();
+						success = handler.loadTGA(saveFiles[comp]->c_str(), &img);
+						double ms = msSince(start);
+						if (best < 0 || ms < best) best = ms;
+						if (success) handler.freeImage(&img);
+					}
+					r.op = loadOps[comp];
+					r.ms = best;
+					r.bytes = static_cast<double>(fs::file_size(*saveFiles[comp], ec));
+					if (success) report(out, r);
+				}
+				if (!success) break;
+
+				// resample, each run on a fresh copy as the source is consumed
+				for (float scale : scales) {
+					double best = -1.0;
+					for (int i = 0; i < reps; i++) {
+						generateImage(&img, size, size, bpp, content);
+						Clock::time_point start = Clock::now();
+						handler.ResampleBillinear(&img, scale, scale);
+						double ms = msSince(start);
+						if (best < 0 || ms < best) best = ms;
+						handler.freeImage(&img);
+					}
+					r.op = "resample";
+					r.scale = scale;
+					r.ms = best;
+					r.bytes = static_cast<double>(size) * size * bpp;
+					report(out, r);
+				}
+			}
+		}
+		// release the pools of this size before moving on to the next
+		releaseMemoryPools();
+	}
+
+	fclose(out);
+	fs::remove(rawFile, ec);
+	fs::remove(rleFile, ec);
+	if (!success) printf("Benchmark stopped, could not write \"%s\"\n", dir.string().c_str());
+	return success;
+}
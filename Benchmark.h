@@ -0,0 +1,26 @@
+#pragma once
+#include "targaHandler.h"
+
+enum CONTENT { FLAT = 0, GRADIENT = 1, NOISE = 2 };
+
+// printable names of CONTENT, indexed by its values
+extern const char* contentName[];
+
+// generateImage
+//
+// Fills img with a synthetic picture taken from the memory pools:
+// FLAT is one colour (best case for RLE), GRADIENT a smooth ramp 
+// (short runs, typical for renders) and NOISE random bytes (worst 
+// case for RLE, no two neighbours equal).
+void generateImage(Image* img, int width, int height, int bpp, CONTENT content);
+
+// runBenchmark
+//
+// Times loadTGA (uncompressed and RLE), ResampleBillinear at several
+// scale factors and saveTGA (uncompressed and RLE) on synthetic 24 
+// and 32 bit images from thumbnail size up to maxSize x maxSize.
+// Results are printed and written as CSV to resultFile.
+//
+// @return false if the result file or the temporary files cannot 
+//         be written
+bool runBenchmark(const char* resultFile, int maxSize, unsigned int threads);
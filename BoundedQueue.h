@@ -0,0 +1,75 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// class BoundedQueue
+//
+// Fixed capacity FIFO connecting two pipeline stages. push blocks 
+// while the queue is full, pop blocks while it is empty and returns 
+// false once the producer has closed the queue and it is drained.
+// Occupancy is sampled on every push so a run can report how full
+// the queue typically was, and how often each side had to wait.
+template<class T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity) {
+		m_capacity = (capacity > 0) ? capacity : 1;
+		m_closed = false;
+		m_pushes = 0;
+		m_occupancySum = 0;
+		m_maxOccupancy = 0;
+		m_fullWaits = 0;
+		m_emptyWaits = 0;
+	}
+
+	void push(T item) {
+		std::unique_lock<std::mutex> lock(m_lock);
+		if (m_items.size() >= m_capacity) m_fullWaits++;
+		m_notFull.wait(lock, [this]() { return m_items.size() < m_capacity; });
+		m_items.push_back(item);
+		m_pushes++;
+		m_occupancySum += m_items.size();
+		if (m_items.size() > m_maxOccupancy) m_maxOccupancy = m_items.size();
+		m_notEmpty.notify_one();
+	}
+
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(m_lock);
+		if (m_items.empty() && !m_closed) m_emptyWaits++;
+		m_notEmpty.wait(lock, [this]() { return !m_items.empty() || m_closed; });
+		if (m_items.empty()) return false;
+		item = m_items.front();
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_closed = true;
+		m_notEmpty.notify_all();
+	}
+
+	size_t capacity() const { return m_capacity; }
+	size_t maxOccupancy() const { return m_maxOccupancy; }
+	size_t fullWaits() const { return m_fullWaits; }
+	size_t emptyWaits() const { return m_emptyWaits; }
+	double averageOccupancy() const {
+		return m_pushes ? static_cast<double>(m_occupancySum) / m_pushes : 0.0;
+	}
+
+private:
+	std::mutex m_lock;
+	std::condition_variable m_notFull;
+	std::condition_variable m_notEmpty;
+	std::deque<T> m_items;
+	size_t m_capacity;
+	bool m_closed;
+
+	size_t m_pushes;
+	size_t m_occupancySum;
+	size_t m_maxOccupancy;
+	size_t m_fullWaits;
+	size_t m_emptyWaits;
+};
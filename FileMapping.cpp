@@ -0,0 +1,64 @@
+#include "FileMapping.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+unsigned char* mapFile(const char* filename, size_t* length) {
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+	                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return NULL;
+
+	// the view keeps the mapping alive, the handle is not needed anymore
+	void* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (base == NULL) return NULL;
+
+	*length = static_cast<size_t>(size.QuadPart);
+	return static_cast<unsigned char*>(base);
+}
+
+void unmapFile(unsigned char* base, size_t length) {
+	(void)length;
+	if (base != NULL) UnmapViewOfFile(base);
+}
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+unsigned char* mapFile(const char* filename, size_t* length) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void* base = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping holds its own reference to the file
+	close(fd);
+	if (base == MAP_FAILED) return NULL;
+
+	// the resampler walks the source top to bottom
+	madvise(base, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+	*length = static_cast<size_t>(st.st_size);
+	return static_cast<unsigned char*>(base);
+}
+
+void unmapFile(unsigned char* base, size_t length) {
+	if (base != NULL) munmap(base, length);
+}
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file, used to let an Image
+// point straight into the page cache instead of copying the pixels
+// into a MemoryManager buffer.
+
+// mapFile
+//
+// @param filename - file to map
+// @param length - receives the size of the mapping in bytes
+//
+// @return base address of the mapping, NULL if the file could
+//         not be opened or mapped
+unsigned char* mapFile(const char* filename, size_t* length);
+
+// unmapFile
+//
+// Releases a mapping returned by mapFile.
+void unmapFile(unsigned char* base, size_t length);
@@ -1,4 +1,5 @@
 #include "MemoryManager.h"
+#include "Metrics.h"
 #include <vector>
 
 // Memory manager based on IBM blog post :
@@ -9,14 +10,28 @@
 // as then Targhandler deploys only one MemoryManager. 
 
 #define MIN_POOLSIZE 1
-#include <type_traits>
 
-template< typename T >
-bool is_aligned(T* p) {
-	return !(reinterpret_cast<uintptr_t>(p) % std::alignment_of<T>::value);
-}
+std::map<uint32_t, SharedPool*> g_MemoryMap;
+std::mutex g_MemoryLock;
+
+// bumped by releaseMemoryPools so thread caches drop stale pointers
+static std::atomic<unsigned int> g_PoolGeneration(0);
+
+// PoolOwner
+//
+// The pools belong to the process, not to the handlers using them:
+// this static owner releases them at exit, after main has returned
+// and every worker thread is joined. Declared after g_MemoryMap and
+// g_MemoryLock, so it is destroyed before them.
+static struct PoolOwner {
+	~PoolOwner() { releaseMemoryPools(); }
+} s_poolOwner;
 
-std::map<uint32_t, MemoryManager*> g_MemoryMap;
+// free blocks a thread keeps per size before handing them back
+#define LOCAL_CACHE_LIMIT 2
+// classes from this size on (image buffers) are handed back at once,
+// they are usually freed on another thread than the one that needs them
+#define LOCAL_CACHE_MAX_CLASS (64 * 1024)
 
 // setPoolSize
 //
@@ -50,46 +65,34 @@ void* MemoryManager::internalAllocate(size_t size) {
 // new nodes corresponding to a specific MemoryManagers size allocation.
 // (see newMemory & freeMemory in MemoryManager.h)
 void MemoryManager::expandPoolSize(size_t size) {
+	METRICS_SCOPE(STAGE_POOL_EXPAND);
 	// if no _NODECOUNT set, default to 1:1 allocation
 	// i.e same cost as using 'new'
 	if (_NODECOUNT == 0) _NODECOUNT = MIN_POOLSIZE;
 
 	size_t ss = (size > sizeof(FreeStore*)) ? size : sizeof(FreeStore*);
+	// every node is preceded by one marker byte and starts on a 16 
+	// byte boundary, so nodes sit at a fixed, 16 aligned stride
+	size_t stride = (ss + 1 + 15) & ~static_cast<size_t>(15);
 
 	// Set total pool to be later carved into pieces
-	size_t totalSize = (ss*_NODECOUNT + _NODECOUNT * 2);
-
-	// exaggerated over-alloc
-	// totalSize = totalSize * 4.0f;
+	size_t totalSize = stride * _NODECOUNT + 1;
 
 	char* allocSize = (char*)_aligned_offset_malloc(totalSize, 16, 1);
 	memset(allocSize, 0, totalSize);
+	m_slabs.push_back(allocSize);
+	m_expansions++;
 	FreeStore* head = reinterpret_cast<FreeStore*> (&allocSize[1]);
 	freeStoreHead = head;
 
 	// Mark this node's padding as true, meaning: beginning of pool 
 	allocSize[0] = true;
 
-	int offset = 0;
-	bool aligned = false;
 	for (int i = 1; i < _NODECOUNT; i++) {
-		head->next = reinterpret_cast<FreeStore*>(&(allocSize)[(ss + 1)*i + offset]);
-		offset = 0;
-		aligned = false;
-
-		char* tmp = (char*)head->next;
-		while (!aligned) {
-			aligned = is_aligned((__m128*)(tmp));
-			if (aligned) {
-				// Mark node as consecutive node (i.e NOT beginning of pool)
-				*(tmp - 1) = false;
-				head->next = reinterpret_cast<FreeStore*>(tmp);
-			}
-			else {
-				tmp = tmp + 1;
-				offset++;
-			}
-		}
+		char* tmp = &allocSize[stride * i + 1];
+		// Mark node as consecutive node (i.e NOT beginning of pool)
+		*(tmp - 1) = false;
+		head->next = reinterpret_cast<FreeStore*>(tmp);
 		head = head->next;
 	}
 	head->next = 0;
@@ -108,22 +111,212 @@ void MemoryManager::free(void* deleted) {
 
 // Cleanup
 //
-// Destroys all memory claimed by the memory manager
+// Destroys all memory claimed by the memory manager. Every slab
+// carved by expandPoolSize is recorded, since with thread caches 
+// the free list no longer sees all nodes.
 void MemoryManager::cleanUp() {
-	FreeStore* nextPtr = freeStoreHead;
-	std::vector<char*> ptrs;
-	for (; nextPtr; nextPtr = freeStoreHead) {
-		char* memChunk = reinterpret_cast<char*> (nextPtr);
-		// check if memChunk points to beginning of memory pool
-		// otherwise if points to just a consecutive node, skip.
-		if (memChunk[-1] == '\x1') {
-			memChunk--;
-			ptrs.push_back(memChunk);
+	for (auto i : m_slabs) {
+		_aligned_free(i);
+	}
+	m_slabs.clear();
+	freeStoreHead = 0;
+}
+
+// sizeClass
+//
+// Rounds a request up to its size class. Small requests go to 64 
+// byte multiples, larger ones to one of four steps per power of two.
+uint32_t sizeClass(size_t bytes) {
+	if (bytes <= 256) return static_cast<uint32_t>((bytes + 63) & ~static_cast<size_t>(63));
+	size_t pow2 = 256;
+	while (pow2 * 2 < bytes) pow2 *= 2;
+	// bytes lies in (pow2, 2*pow2], split that range in four
+	size_t step = pow2 / 4;
+	return static_cast<uint32_t>(pow2 + ((bytes - pow2 + step - 1) / step) * step);
+}
+
+// LocalList
+//
+// A thread's private free list for one size class.
+struct LocalList {
+	SharedPool* pool;
+	PoolNode* head;
+	unsigned int count;
+};
+
+struct ThreadCache {
+	std::map<uint32_t, LocalList> lists;
+	unsigned int generation;
+};
+
+static thread_local ThreadCache t_cache;
+
+// localList
+//
+// This thread's list for a class, finding or creating the shared 
+// pool under g_MemoryLock the first time the class is seen.
+static LocalList& localList(uint32_t classSize, unsigned int nrOfAlloc) {
+	unsigned int generation = g_PoolGeneration.load(std::memory_order_acquire);
+	if (t_cache.generation != generation) {
+		// pools were released, the cached nodes are gone with them
+		t_cache.lists.clear();
+		t_cache.generation = generation;
+	}
+	auto found = t_cache.lists.find(classSize);
+	if (found != std::end(t_cache.lists))
+		return found->second;
+
+	std::lock_guard<std::mutex> guard(g_MemoryLock);
+	SharedPool*& pool = g_MemoryMap[classSize];
+	if (pool == NULL) {
+		pool = new SharedPool();
+		pool->manager.setNumberOfAllocations(nrOfAlloc);
+	}
+	LocalList& list = t_cache.lists[classSize];
+	list.pool = pool;
+	list.head = NULL;
+	list.count = 0;
+	return list;
+}
+
+// poolAllocate
+//
+// Fast path pops the thread's own list. When it is empty the whole
+// returned stack of the shared pool is taken over, and only if that
+// is empty as well the MemoryManager is asked, under its lock.
+//
+// @param bytes - bytes needed by the caller
+// @param nrOfAlloc - pre-allocations for a new pool (see setExpectedRuns)
+void* poolAllocate(size_t bytes, unsigned int nrOfAlloc) {
+	uint32_t classSize = sizeClass(bytes);
+	LocalList& list = localList(classSize, nrOfAlloc);
+	if (list.head == NULL) {
+		PoolNode* taken = list.pool->returned.exchange(nullptr, std::memory_order_acquire);
+		if (taken != NULL) {
+			list.head = taken;
+			list.count = 0;
+			for (PoolNode* n = taken; n != NULL; n = n->next) list.count++;
+		}
+		else {
+			list.pool->misses.fetch_add(1, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> guard(list.pool->lock);
+			return list.pool->manager.allocate<char>(classSize);
 		}
-		freeStoreHead = freeStoreHead->next;
 	}
-	// delete / free
-	for (auto i : ptrs) {
+	list.pool->hits.fetch_add(1, std::memory_order_relaxed);
+	PoolNode* node = list.head;
+	list.head = node->next;
+	list.count--;
+	return node;
+}
+
+// poolFree
+//
+// Keeps small blocks in the thread's list up to LOCAL_CACHE_LIMIT,
+// anything else is pushed onto the shared returned stack so other
+// threads (e.g. the loader of a batch) get it back. The push is a
+// plain compare-and-swap loop; since blocks only ever leave the 
+// stack all at once, it is not exposed to ABA.
+//
+// @param bytes - the size the block was allocated with
+bool poolFree(void* ptr, size_t bytes) {
+	uint32_t classSize = sizeClass(bytes);
+	LocalList& list = localList(classSize, 0);
+	PoolNode* node = static_cast<PoolNode*>(ptr);
+	if (classSize < LOCAL_CACHE_MAX_CLASS && list.count < LOCAL_CACHE_LIMIT) {
+		node->next = list.head;
+		list.head = node;
+		list.count++;
+		return true;
+	}
+	PoolNode* head = list.pool->returned.load(std::memory_order_relaxed);
+	do {
+		node->next = head;
+	} while (!list.pool->returned.compare_exchange_weak(head, node,
+		std::memory_order_release, std::memory_order_relaxed));
+	return true;
+}
+
+// getPoolStats
+//
+// Hit/miss/expansion counts of every size class in use.
+void getPoolStats(std::vector<PoolStats>& stats) {
+	std::lock_guard<std::mutex> guard(g_MemoryLock);
+	stats.clear();
+	for (auto const& p : g_MemoryMap) {
+		std::lock_guard<std::mutex> poolGuard(p.second->lock);
+		stats.push_back(PoolStats{ p.first, p.second->hits.load(), 
+			p.second->misses.load(), p.second->manager.expansions() });
+	}
+}
+
+// releaseMemoryPools
+//
+// Destroys every shared pool and the memory they handed out. Runs at
+// exit (see PoolOwner); call it earlier only where no pool memory is
+// in use and no other thread allocates, e.g. the benchmark between
+// image sizes. Thread caches notice the new generation and start over
+// on their next call.
+void releaseMemoryPools() {
+	std::lock_guard<std::mutex> guard(g_MemoryLock);
+	for (auto const& p : g_MemoryMap) {
+		delete p.second;
+		// Note: deleting a SharedPool deletes its MemoryManager,
+		// launching MemoryManager::cleanUp() which frees all slabs
+	}
+	g_MemoryMap.clear();
+	g_PoolGeneration++;
+}
+
+// ScratchArena
+//
+// Starts empty, the first reset() sizes the block to what the first
+// operation needed.
+ScratchArena::ScratchArena() : m_used(0), m_allocations(0) {
+	m_block = NULL;
+	m_capacity = 0;
+	m_peak = 0;
+	m_overflows = 0;
+}
+
+ScratchArena::~ScratchArena() {
+	reset();
+	_aligned_free(m_block);
+}
+
+// internalAllocate
+//
+// Claims 16 byte aligned space with a single atomic add. Requests
+// that do not fit get a separate block until the next reset.
+void* ScratchArena::internalAllocate(size_t size) {
+	size_t need = (size + 15) & ~static_cast<size_t>(15);
+	m_allocations.fetch_add(1, std::memory_order_relaxed);
+	size_t offset = m_used.fetch_add(need);
+	if (offset + need <= m_capacity)
+		return m_block + offset;
+
+	std::lock_guard<std::mutex> guard(m_overflowLock);
+	char* extra = (char*)_aligned_offset_malloc(need, 16, 0);
+	m_overflow.push_back(extra);
+	m_overflows++;
+	return extra;
+}
+
+// reset
+//
+// Releases everything handed out since the last reset. If the block
+// overflowed it is replaced by one large enough for that peak.
+void ScratchArena::reset() {
+	size_t used = m_used.load();
+	if (used > m_peak) m_peak = used;
+	for (auto i : m_overflow) {
 		_aligned_free(i);
 	}
+	m_overflow.clear();
+	if (used > m_capacity) {
+		_aligned_free(m_block);
+		m_block = (char*)_aligned_offset_malloc(used, 16, 0);
+		m_capacity = used;
+	}
+	m_used = 0;
 }
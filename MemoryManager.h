@@ -1,5 +1,8 @@
+#pragma once
 #include "IMemoryManager.h"
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <vector>
 class MemoryManager : public IMemoryManager {
 	struct FreeStore {
@@ -8,11 +11,14 @@ class MemoryManager : public IMemoryManager {
 	void expandPoolSize(size_t size);
 	void cleanUp();
 	FreeStore* freeStoreHead;
+	std::vector<char*> m_slabs;
+	unsigned int m_expansions;
 
 	size_t chunkSize;
 public:
 	MemoryManager() {
 		freeStoreHead = 0;
+		m_expansions = 0;
 	}
 	virtual ~MemoryManager() {
 		cleanUp();
@@ -23,8 +29,78 @@ public:
 	virtual void  setNumberOfAllocations(size_t);
 	virtual void* internalAllocate(size_t);
 	virtual void  free(void*);
+
+	unsigned int expansions() const { return m_expansions; }
 };
 
+// class ScratchArena
+//
+// Bump allocator for short lived scratch (row buffers, per-call 
+// tables) that is thrown away as a whole by reset() at the end of
+// an operation. Allocation is one atomic add, so resample bands on
+// several threads can share an arena. Requests beyond the current
+// block get their own overflow block; on reset the block is grown 
+// to the peak seen, so a repeated operation settles on one block.
+class ScratchArena : public IMemoryManager {
+public:
+	ScratchArena();
+	virtual ~ScratchArena();
+
+	void reset();
+	virtual void free(void*) {}
+
+	size_t capacity() const { return m_capacity; }
+	size_t peak() const { return m_peak; }
+	unsigned int allocations() const { return m_allocations; }
+	unsigned int overflows() const { return m_overflows; }
+
+protected:
+	virtual void* internalAllocate(size_t);
+
+private:
+	char* m_block;
+	size_t m_capacity;
+	std::atomic<size_t> m_used;
+	std::mutex m_overflowLock;
+	std::vector<char*> m_overflow;
+
+	size_t m_peak;
+	std::atomic<unsigned int> m_allocations;
+	unsigned int m_overflows;
+};
+
+// SharedPool
+//
+// The MemoryManager serving one size class, shared by all threads.
+// The manager itself is only touched under 'lock', on the slow path.
+// Blocks that threads give back beyond what they cache locally are
+// pushed onto 'returned', a lock-free stack that any thread can take
+// over as a whole with one atomic exchange. 'hits' counts requests 
+// served from a thread cache or the returned stack, 'misses' those
+// that had to go to the manager (which may expand the pool).
+struct PoolNode {
+	PoolNode* next;
+};
+
+struct SharedPool {
+	std::mutex lock;
+	MemoryManager manager;
+	std::atomic<PoolNode*> returned;
+	std::atomic<unsigned int> hits;
+	std::atomic<unsigned int> misses;
+	SharedPool() : returned(nullptr), hits(0), misses(0) {}
+};
+
+// PoolStats
+//
+// Snapshot of one size class, see getPoolStats.
+typedef struct {
+	uint32_t classSize;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int expansions;
+} PoolStats;
+
 // std::map fascilitating different size allocations
 //
 // The strategy is as follows: If a user decides to to run 
@@ -32,29 +108,34 @@ public:
 // then each image of a specific resolution WxH creates its  
 // dedicated MemoryManager. If the same resolution is encountered
 // then there is already memory reserved for a resize operation.
+//
+// Requests are rounded up to a size class first: four classes per
+// power of two (at most 25% slack), so images of similar but not 
+// identical resolution still share a pool. 
+//
+// Each thread keeps a small cache of free blocks per class in front
+// of the shared pools, so allocating and freeing an image buffer 
+// takes no lock as long as the cache or the returned stack can 
+// serve it. g_MemoryLock only guards this map, which a thread 
+// consults the first time it meets a class.
+
+extern std::map<uint32_t, SharedPool*> g_MemoryMap;
+extern std::mutex g_MemoryLock;
 
-extern std::map<uint32_t, MemoryManager*> g_MemoryMap;
+uint32_t sizeClass(size_t bytes);
+void* poolAllocate(size_t bytes, unsigned int nrOfAlloc);
+bool  poolFree(void* ptr, size_t bytes);
+void  releaseMemoryPools();
+void  getPoolStats(std::vector<PoolStats>& stats);
 
 // simplified allocation 
 template<class T>
 static T* newMemory(size_t size, unsigned int nrOfAlloc) {
-	if (g_MemoryMap.find(size) == std::end(g_MemoryMap)) {
-		g_MemoryMap[size] = new MemoryManager();
-		g_MemoryMap[size]->setNumberOfAllocations(nrOfAlloc);
-	}
-	return g_MemoryMap[size]->allocate<T>(size);
+	return reinterpret_cast<T*>(poolAllocate(size * sizeof(T), nrOfAlloc));
 }
 
-static bool freeMemory(void* ptr, uint32_t size) {
-	if (g_MemoryMap.find(size) == std::end(g_MemoryMap)) {
-		printf("Error, no key in map corresponding to size %i", size);
-		return false;
-	}
-	g_MemoryMap[size]->free(ptr);
-	return true;
+// size is the element count passed to newMemory
+template<class T>
+static bool freeMemory(T* ptr, size_t size) {
+	return poolFree(ptr, size * sizeof(T));
 }
-
-/*template<class T>
-static T* newMemory(uint32_t id) {
-return g_MemoryMap[id]->allocate<T>(sizeof(T));
-}*/
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "Metrics.h"
+#include <stdio.h>
+
+std::atomic<uint64_t> g_StageCalls[STAGE_COUNT];
+std::atomic<uint64_t> g_StageNanoseconds[STAGE_COUNT];
+std::atomic<uint64_t> g_Counters[COUNTER_COUNT];
+
+static const char* s_stageNames[STAGE_COUNT] = {
+	"header", "read", "decode", "resample", "encode", "write", "stream", "pool_expand"
+};
+static const char* s_counterNames[COUNTER_COUNT] = {
+	"bytes_read", "bytes_written", "pixels_decoded", "pixels_resampled", "pixels_encoded"
+};
+
+const char* stageName(STAGE stage) { return s_stageNames[stage]; }
+const char* counterName(COUNTER counter) { return s_counterNames[counter]; }
+
+// getMetrics
+void getMetrics(Metrics* m) {
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		m->calls[i] = g_StageCalls[i].load(std::memory_order_relaxed);
+		m->nanoseconds[i] = g_StageNanoseconds[i].load(std::memory_order_relaxed);
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		m->counters[i] = g_Counters[i].load(std::memory_order_relaxed);
+}
+
+// resetMetrics
+void resetMetrics() {
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		g_StageCalls[i] = 0;
+		g_StageNanoseconds[i] = 0;
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		g_Counters[i] = 0;
+}
+
+// metricsToJSON
+std::string metricsToJSON(const std::vector<PoolStats>& pools) {
+	Metrics m;
+	getMetrics(&m);
+	char line[256];
+	std::string json = "{\n  \"enabled\": ";
+	json += TGA_METRICS ? "true" : "false";
+	json += ",\n  \"stages\": {\n";
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		snprintf(line, sizeof(line), "    \"%s\": { \"calls\": %llu, \"ms\": %.3f }%s\n",
+			s_stageNames[i], (unsigned long long)m.calls[i], m.nanoseconds[i] / 1e6,
+			(i + 1 < STAGE_COUNT) ? "," : "");
+		json += line;
+	}
+	json += "  },\n  \"counters\": {\n";
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		snprintf(line, sizeof(line), "    \"%s\": %llu%s\n", s_counterNames[i],
+			(unsigned long long)m.counters[i], (i + 1 < COUNTER_COUNT) ? "," : "");
+		json += line;
+	}
+	json += "  },\n  \"pools\": [\n";
+	for (size_t i = 0; i < pools.size(); i++) {
+		snprintf(line, sizeof(line),
+			"    { \"class\": %u, \"hits\": %u, \"misses\": %u, \"expansions\": %u }%s\n",
+			pools[i].classSize, pools[i].hits, pools[i].misses, pools[i].expansions,
+			(i + 1 < pools.size()) ? "," : "");
+		json += line;
+	}
+	json += "  ]\n}\n";
+	return json;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "MemoryManager.h"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Hot path instrumentation
+//
+// Per stage wall time and call counts plus byte and pixel counters,
+// accumulated process wide in relaxed atomics so TargaHandlers on 
+// any thread can report into them. Compile with TGA_METRICS=0 to 
+// remove every probe; the API below then reports zeros.
+#ifndef TGA_METRICS
+#define TGA_METRICS 1
+#endif
+
+enum STAGE {
+	STAGE_HEADER = 0,   // readHeader
+	STAGE_READ,         // fread / mapping of pixel or packet data
+	STAGE_DECODE,       // RLE expansion
+	STAGE_RESAMPLE,     // ResampleBillinear
+	STAGE_ENCODE,       // RLE packing
+	STAGE_WRITE,        // header and pixel fwrite
+	STAGE_STREAM,       // resizeStreaming, decode to write
+	STAGE_POOL_EXPAND,  // MemoryManager::expandPoolSize
+	STAGE_COUNT
+};
+
+enum COUNTER {
+	BYTES_READ = 0,
+	BYTES_WRITTEN,
+	PIXELS_DECODED,
+	PIXELS_RESAMPLED,   // destination pixels
+	PIXELS_ENCODED,
+	COUNTER_COUNT
+};
+
+// Metrics
+//
+// Snapshot of all stages and counters, see getMetrics.
+typedef struct {
+	uint64_t calls[STAGE_COUNT];
+	uint64_t nanoseconds[STAGE_COUNT];
+	uint64_t counters[COUNTER_COUNT];
+} Metrics;
+
+extern std::atomic<uint64_t> g_StageCalls[STAGE_COUNT];
+extern std::atomic<uint64_t> g_StageNanoseconds[STAGE_COUNT];
+extern std::atomic<uint64_t> g_Counters[COUNTER_COUNT];
+
+void getMetrics(Metrics* m);
+void resetMetrics();
+const char* stageName(STAGE stage);
+const char* counterName(COUNTER counter);
+
+// metricsToJSON
+//
+// All stages, counters and the given pool statistics as one JSON
+// object (pools are passed in since they may already be released).
+std::string metricsToJSON(const std::vector<PoolStats>& pools);
+
+#if TGA_METRICS
+// StageTimer
+//
+// Adds the lifetime of the object to a stage.
+class StageTimer {
+public:
+	StageTimer(STAGE stage) : m_stage(stage), m_start(std::chrono::steady_clock::now()) {}
+	~StageTimer() {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - m_start).count();
+		g_StageCalls[m_stage].fetch_add(1, std::memory_order_relaxed);
+		g_StageNanoseconds[m_stage].fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+	}
+private:
+	STAGE m_stage;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+#define METRICS_SCOPE(stage) StageTimer METRICS_CONCAT(stageTimer_, __LINE__)(stage)
+#define METRICS_ADD(counter, n) \
+	g_Counters[counter].fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed)
+#else
+#define METRICS_SCOPE(stage) ((void)0)
+#define METRICS_ADD(counter, n) ((void)0)
+#endif
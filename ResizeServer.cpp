@@ -0,0 +1,299 @@
+#include "ResizeServer.h"
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// connections accepted but not yet picked up by a worker
+#define PENDING_CONNECTIONS 64
+
+typedef std::chrono::steady_clock Clock;
+
+static double msSince(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Constructor
+//
+// @param workers - jobs resized at the same time, each worker owns
+//        a TargaHandler (and its resample threads, see setThreadCount)
+ResizeServer::ResizeServer(unsigned int workers) : m_connections(PENDING_CONNECTIONS) {
+	m_workers = (workers > 0) ? workers : 1;
+	m_stopping = false;
+	m_listenFd = -1;
+	m_jobs = 0;
+	m_failed = 0;
+	m_totalMs = 0.0;
+	m_maxMs = 0.0;
+	m_resampleThreads = 1;
+	m_mapFiles = false;
+	m_boxFilter = true;
+	m_filter = BILINEAR;
+	m_kernel = SEPARABLE;
+	m_tileWidth = 0;
+	m_tileHeight = 0;
+	m_padded = false;
+}
+
+ResizeServer::~ResizeServer() {
+}
+
+// handleRequest
+//
+// Runs one job on this worker's handler.
+//
+// @param line - "input output scalex scaley compression", tab
+//               separated so that paths may contain spaces
+//
+// @return the reply line, without the newline
+std::string ResizeServer::handleRequest(TargaHandler* handler, const std::string& line) {
+	std::istringstream fields(line);
+	std::vector<std::string> field;
+	std::string f;
+	while (std::getline(fields, f, '\t')) field.push_back(f);
+	if (field.size() != 5)
+		return "ERR expected: input<TAB>output<TAB>scalex<TAB>scaley<TAB>uncompressed|rle";
+	const std::string& input = field[0];
+	const std::string& output = field[1];
+	const std::string& comp = field[4];
+	char* end;
+	float scalex = strtof(field[2].c_str(), &end);
+	if (field[2].empty() || *end != '\0') scalex = 0;
+	float scaley = strtof(field[3].c_str(), &end);
+	if (field[3].empty() || *end != '\0') scaley = 0;
+	if (scalex <= 0 || scaley <= 0)
+		return "ERR scale factors must be > 0";
+	if (comp != "uncompressed" && comp != "rle")
+		return "ERR compression must be uncompressed or rle";
+
+	Clock::time_point start = Clock::now();
+	Image image;
+	bool ok = handler->loadTGA(input.c_str(), &image);
+	double loadMs = msSince(start);
+	double resizeMs = 0.0, saveMs = 0.0;
+	const char* error = "cannot load input";
+	if (ok) {
+		Clock::time_point step = Clock::now();
+		handler->ResampleBillinear(&image, scalex, scaley);
+		resizeMs = msSince(step);
+		step = Clock::now();
+		ok = handler->saveTGA(output.c_str(), &image, (comp == "rle") ? RLE : UNCOMPRESSED);
+		saveMs = msSince(step);
+		error = "cannot save output";
+	}
+	double totalMs = msSince(start);
+
+	unsigned int job;
+	{
+		std::lock_guard<std::mutex> guard(m_statsLock);
+		job = ++m_jobs;
+		if (!ok) m_failed++;
+		m_totalMs += totalMs;
+		if (totalMs > m_maxMs) m_maxMs = totalMs;
+	}
+	char reply[128];
+	if (ok) {
+		printf("job %u: \"%s\" -> \"%s\" %dx%d %.2f ms\n", job, input.c_str(), output.c_str(),
+			image.width, image.height, totalMs);
+		snprintf(reply, sizeof(reply), "OK %dx%d %.2f %.2f %.2f %.2f",
+			image.width, image.height, loadMs, resizeMs, saveMs, totalMs);
+	}
+	else {
+		printf("job %u: \"%s\" failed, %s\n", job, input.c_str(), error);
+		snprintf(reply, sizeof(reply), "ERR %s", error);
+	}
+	return reply;
+}
+
+// worker
+//
+// Serves connections until the server stops, all with one handler
+// that lives as long as the worker.
+void ResizeServer::worker() {
+	TargaHandler handler;
+	handler.setVerbose(false);
+	handler.setThreadCount(m_resampleThreads);
+	handler.setMemoryMapping(m_mapFiles);
+	handler.setBoxFilter(m_boxFilter);
+	handler.setFilter(m_filter);
+	handler.setKernel(m_kernel);
+	handler.setTileSize(m_tileWidth, m_tileHeight);
+	handler.setPaddedLayout(m_padded);
+	int fd;
+	while (m_connections.pop(fd))
+		serve(&handler, fd);
+}
+
+// printReport
+//
+// Job count and latency over the life of the server.
+void ResizeServer::printReport() {
+	std::lock_guard<std::mutex> guard(m_statsLock);
+	printf("Served %u jobs, %u failed, latency avg %.2f ms max %.2f ms\n",
+		m_jobs, m_failed, m_jobs ? m_totalMs / m_jobs : 0.0, m_maxMs);
+}
+
+#ifndef _WIN32
+// sendAll
+//
+// send until every byte is out, without SIGPIPE if the peer is gone.
+static bool sendAll(int fd, const std::string& data) {
+	size_t sent = 0;
+	while (sent < data.size()) {
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		sent += static_cast<size_t>(n);
+	}
+	return true;
+}
+
+// socketAddress
+//
+// @return false if the path does not fit into sockaddr_un
+static bool socketAddress(const char* path, struct sockaddr_un* addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("Socket path \"%s\" is too long\n", path);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+// run
+//
+// Listens on socketPath until a QUIT request. A stale socket left by
+// an earlier server is replaced, any other file is not touched.
+//
+// @return false if the socket cannot be set up
+bool ResizeServer::run(const char* socketPath) {
+	struct sockaddr_un addr;
+	if (!socketAddress(socketPath, &addr))
+		return false;
+	struct stat st;
+	if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socketPath);
+
+	// the socket is created owner-only (0600): whoever can connect can
+	// have any file the server may write overwritten. umask is process
+	// wide, but no other thread runs yet.
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	mode_t mask = umask(0177);
+	bool bound = m_listenFd >= 0 && bind(m_listenFd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || listen(m_listenFd, PENDING_CONNECTIONS) != 0) {
+		printf("Cannot listen on \"%s\": %s\n", socketPath, strerror(errno));
+		if (m_listenFd >= 0) close(m_listenFd);
+		m_listenFd = -1;
+		return false;
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < m_workers; i++)
+		threads.push_back(std::thread(&ResizeServer::worker, this));
+	printf("Serving on \"%s\" with %u workers\n", socketPath, m_workers);
+	fflush(stdout);
+
+	while (!m_stopping) {
+		int fd = accept(m_listenFd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR && !m_stopping) continue;
+			break;
+		}
+		m_connections.push(fd);
+	}
+	m_connections.close();
+	for (auto& t : threads) t.join();
+	close(m_listenFd);
+	m_listenFd = -1;
+	unlink(socketPath);
+	return true;
+}
+
+// serve
+//
+// Answers the request lines of one connection in order until the
+// client closes it.
+void ResizeServer::serve(TargaHandler* handler, int fd) {
+	std::string pending;
+	char buff[4096];
+	bool open = true;
+	while (open) {
+		ssize_t n = recv(fd, buff, sizeof(buff), 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		pending.append(buff, static_cast<size_t>(n));
+		size_t eol;
+		while (open && (eol = pending.find('\n')) != std::string::npos) {
+			std::string line = pending.substr(0, eol);
+			pending.erase(0, eol + 1);
+			if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+			if (line.empty()) continue;
+			if (line == "QUIT") {
+				// wakes the accept loop, running jobs still finish
+				m_stopping = true;
+				shutdown(m_listenFd, SHUT_RDWR);
+				sendAll(fd, "OK\n");
+				open = false;
+				break;
+			}
+			open = sendAll(fd, handleRequest(handler, line) + "\n");
+		}
+	}
+	close(fd);
+}
+
+bool sendResizeRequest(const char* socketPath, const std::string& request, std::string* reply) {
+	struct sockaddr_un addr;
+	if (!socketAddress(socketPath, &addr))
+		return false;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		printf("Cannot connect to \"%s\": %s\n", socketPath, strerror(errno));
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	bool ok = sendAll(fd, request + "\n");
+	reply->clear();
+	char c;
+	while (ok) {
+		ssize_t n = recv(fd, &c, 1, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0 || c == '\n') break;
+		reply->push_back(c);
+	}
+	close(fd);
+	return ok && !reply->empty();
+}
+
+#else
+// Unix domain sockets are not used on Windows, -serve is unavailable
+
+bool ResizeServer::run(const char* socketPath) {
+	printf("Cannot serve on \"%s\": no Unix domain sockets on this platform\n", socketPath);
+	return false;
+}
+
+void ResizeServer::serve(TargaHandler* handler, int fd) {
+	(void)handler;
+	(void)fd;
+}
+
+bool sendResizeRequest(const char* socketPath, const std::string& request, std::string* reply) {
+	(void)request;
+	reply->clear();
+	printf("Cannot connect to \"%s\": no Unix domain sockets on this platform\n", socketPath);
+	return false;
+}
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+#include "targaHandler.h"
+#include "BoundedQueue.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// class ResizeServer
+//
+// Resident resize service on a Unix domain socket, so that a caller
+// resizing one image per invocation does not pay for pool set-up and
+// page faults every time. A connection sends request lines
+//   input<TAB>output<TAB>scalex<TAB>scaley<TAB>compression
+// separated by single tabs, so that paths may contain spaces (but no
+// tabs or newlines), where compression is "uncompressed" or "rle",
+// and gets one reply line per request:
+//   OK WxH load_ms resize_ms save_ms total_ms
+//   ERR reason
+// Connections are served by a fixed set of workers, each with its own
+// TargaHandler that lives as long as the server, so memory pools and
+// resample / filter tables stay warm from one job to the next. A
+// "QUIT" line stops the server once running jobs are done. The socket
+// is only accessible to the user running the server.
+class ResizeServer {
+public:
+	ResizeServer(unsigned int workers = 2);
+	~ResizeServer();
+
+	void setThreadCount(unsigned int threads) { m_resampleThreads = threads; }
+	void setMemoryMapping(bool enable) { m_mapFiles = enable; }
+	void setBoxFilter(bool enable) { m_boxFilter = enable; }
+	void setFilter(FILTER filter) { m_filter = filter; }
+	void setKernel(KERNEL kernel) { m_kernel = kernel; }
+	void setTileSize(int width, int height) { m_tileWidth = width; m_tileHeight = height; }
+	void setPaddedLayout(bool enable) { m_padded = enable; }
+
+	bool run(const char* socketPath);
+	void printReport();
+
+private:
+	void worker();
+	void serve(TargaHandler* handler, int fd);
+	std::string handleRequest(TargaHandler* handler, const std::string& line);
+
+	BoundedQueue<int> m_connections;
+	std::atomic<bool> m_stopping;
+	int m_listenFd;
+	unsigned int m_workers;
+
+	// per job latency, summed over all workers
+	std::mutex m_statsLock;
+	unsigned int m_jobs;
+	unsigned int m_failed;
+	double m_totalMs;
+	double m_maxMs;
+
+	unsigned int m_resampleThreads;
+	bool m_mapFiles;
+	bool m_boxFilter;
+	FILTER m_filter;
+	KERNEL m_kernel;
+	int m_tileWidth;
+	int m_tileHeight;
+	bool m_padded;
+};
+
+// sendResizeRequest
+//
+// Client side of ResizeServer: sends one request line and waits for
+// its reply.
+//
+// @param socketPath - socket the server listens on
+// @param request - request line, without the newline
+// @param reply - receives the reply line, without the newline
+//
+// @return false if the server cannot be reached
+bool sendResizeRequest(const char* socketPath, const std::string& request, std::string* reply);
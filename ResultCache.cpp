@@ -0,0 +1,260 @@
+#include "ResultCache.h"
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// inputs are hashed in blocks of this size, a multiple of 32
+#define HASH_BLOCK (1 << 20)
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mixLane(uint64_t lane, uint64_t v) {
+	return rotl64(lane + v * PRIME2, 31) * PRIME1;
+}
+
+// Hash64
+//
+// Streaming 64 bit hash in the style of xxHash64: four independent
+// lanes take 8 bytes each per 32 byte stripe, so the loop runs at
+// memory speed. Not cryptographic, a cache key only has to tell
+// different inputs apart.
+typedef struct {
+	uint64_t lane[4];
+	uint64_t length;
+} Hash64;
+
+static void hashInit(Hash64* h) {
+	h->lane[0] = PRIME1 + PRIME2;
+	h->lane[1] = PRIME2;
+	h->lane[2] = 0;
+	h->lane[3] = 0 - PRIME1;
+	h->length = 0;
+}
+
+// hashStripes
+//
+// Consumes the whole 32 byte stripes of data.
+//
+// @return bytes consumed
+static size_t hashStripes(Hash64* h, const unsigned char* data, size_t len) {
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t v;
+			memcpy(&v, data + i + l * 8, 8);
+			h->lane[l] = mixLane(h->lane[l], v);
+		}
+	}
+	h->length += i;
+	return i;
+}
+
+// hashFinish
+//
+// Folds the lanes, the tail shorter than a stripe and the length.
+static uint64_t hashFinish(Hash64* h, const unsigned char* tail, size_t len) {
+	uint64_t acc = rotl64(h->lane[0], 1) + rotl64(h->lane[1], 7)
+	             + rotl64(h->lane[2], 12) + rotl64(h->lane[3], 18);
+	acc += h->length + len;
+	for (size_t i = 0; i < len; i++)
+		acc = rotl64(acc ^ (tail[i] * PRIME3), 11) * PRIME1;
+	acc ^= acc >> 33;
+	acc *= PRIME2;
+	acc ^= acc >> 29;
+	acc *= PRIME3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+static uint64_t hashBytes(const void* data, size_t len) {
+	Hash64 h;
+	hashInit(&h);
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	size_t used = hashStripes(&h, p, len);
+	return hashFinish(&h, p + used, len - used);
+}
+
+// Constructor
+//
+// Creates dir if needed and indexes the entries already in it, so
+// a cache is shared by every run pointing at the same directory.
+//
+// @param maxBytes - size cap of all entries together
+ResultCache::ResultCache(const char* dir, uint64_t maxBytes) {
+	m_dir = dir;
+	m_maxBytes = maxBytes;
+	m_bytes = 0;
+	m_hardLinks = false;
+	m_hits = m_misses = m_evictions = 0;
+	std::error_code ec;
+	fs::create_directories(m_dir, ec);
+	for (auto const& f : fs::directory_iterator(m_dir, ec)) {
+		if (!f.is_regular_file() || f.path().extension() != ".tga") continue;
+		Entry e = { f.path().filename().string(), f.file_size(ec), f.last_write_time(ec) };
+		m_bytes += e.size;
+		m_entries.push_back(e);
+	}
+}
+
+// key
+//
+// Hashes the bytes of input and the output parameters.
+//
+// @return 32 hex digits, empty if input cannot be read
+std::string ResultCache::key(const char* input, float scalex, float scaley, FILTER filter,
+                             KERNEL kernel, bool boxFilter, COMPRESSION comp) {
+	FILE* filePtr;
+	fopen_s(&filePtr, input, "rb");
+	if (filePtr == NULL) return std::string();
+	std::vector<unsigned char> block(HASH_BLOCK);
+	Hash64 h;
+	hashInit(&h);
+	size_t n;
+	while ((n = fread(block.data(), 1, HASH_BLOCK, filePtr)) == HASH_BLOCK)
+		hashStripes(&h, block.data(), n);
+	fclose(filePtr);
+	size_t used = hashStripes(&h, block.data(), n);
+	uint64_t content = hashFinish(&h, block.data() + used, n - used);
+
+	// %a prints the exact float, 0.3 and 0.30000001 are different keys.
+	// Only FIXED rounds differently from the float kernels, the others
+	// keep the keys they had before it existed.
+	char params[128];
+	int len = snprintf(params, sizeof(params), "%a %a %d %d %d%s", scalex, scaley,
+		static_cast<int>(filter), boxFilter ? 1 : 0, static_cast<int>(comp),
+		(kernel == FIXED) ? " fixed" : "");
+	uint64_t settings = hashBytes(params, static_cast<size_t>(len));
+
+	char hex[33];
+	snprintf(hex, sizeof(hex), "%016llx%016llx",
+		static_cast<unsigned long long>(content), static_cast<unsigned long long>(settings));
+	return hex;
+}
+
+// place
+//
+// Puts a copy of 'from' at 'to', as a hard link if enabled and the
+// file system allows it. 'to' is removed first rather than written
+// over, it may itself be a link to a cache entry.
+bool ResultCache::place(const fs::path& from, const fs::path& to) {
+	std::error_code ec;
+	fs::remove(to, ec);
+	if (m_hardLinks) {
+		fs::create_hard_link(from, to, ec);
+		if (!ec) return true;
+	}
+	return fs::copy_file(from, to, ec);
+}
+
+// fetch
+//
+// On a hit the stored result is placed at output and the entry
+// becomes the most recently used one.
+//
+// @return false on a miss. With hard links output is removed then, 
+//         it may be a link into the cache from an earlier hit and
+//         writing the new result through it would change that entry
+bool ResultCache::fetch(const std::string& key, const char* output) {
+	if (key.empty()) return false;
+	std::string name = key + ".tga";
+	fs::path entry = m_dir / name;
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::error_code ec;
+	if (!fs::is_regular_file(entry, ec) || !place(entry, output)) {
+		if (m_hardLinks) fs::remove(output, ec);
+		m_misses++;
+		return false;
+	}
+	fs::file_time_type now = fs::file_time_type::clock::now();
+	fs::last_write_time(entry, now, ec);
+	for (auto& e : m_entries) {
+		if (e.name == name) e.used = now;
+	}
+	m_hits++;
+	return true;
+}
+
+// store
+//
+// Adds a freshly written output under key, then evicts least
+// recently used entries until the cache is within its cap. The entry
+// is written under a temporary name and renamed, so concurrent runs
+// never see half a file. The temporary name carries the process id,
+// the thread id and a counter: m_lock only orders the threads of one
+// process, two runs sharing the directory must not write through the
+// same path.
+void ResultCache::store(const std::string& key, const char* output) {
+	if (key.empty()) return;
+	std::string name = key + ".tga";
+	std::error_code ec;
+	uint64_t size = fs::file_size(output, ec);
+	if (ec || size > m_maxBytes) return;
+
+	std::lock_guard<std::mutex> guard(m_lock);
+	static std::atomic<unsigned int> s_tempCount(0);
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%d.%zx.%u.tmp", static_cast<int>(getpid()),
+	         std::hash<std::thread::id>()(std::this_thread::get_id()), s_tempCount++);
+	fs::path temp = m_dir / (name + suffix);
+	if (!place(output, temp)) return;
+	fs::rename(temp, m_dir / name, ec);
+	if (ec) {
+		fs::remove(temp, ec);
+		return;
+	}
+	bool found = false;
+	for (auto& e : m_entries) {
+		if (e.name != name) continue;
+		m_bytes = m_bytes - e.size + size;
+		e.size = size;
+		e.used = fs::file_time_type::clock::now();
+		found = true;
+	}
+	if (!found) {
+		m_entries.push_back(Entry{ name, size, fs::file_time_type::clock::now() });
+		m_bytes += size;
+	}
+	evict();
+}
+
+// evict
+//
+// Removes the least recently used entries while over the cap.
+void ResultCache::evict() {
+	while (m_bytes > m_maxBytes && !m_entries.empty()) {
+		size_t oldest = 0;
+		for (size_t i = 1; i < m_entries.size(); i++) {
+			if (m_entries[i].used < m_entries[oldest].used) oldest = i;
+		}
+		std::error_code ec;
+		fs::remove(m_dir / m_entries[oldest].name, ec);
+		m_bytes -= m_entries[oldest].size;
+		m_entries.erase(m_entries.begin() + oldest);
+		m_evictions++;
+	}
+}
+
+// printReport
+void ResultCache::printReport() {
+	std::lock_guard<std::mutex> guard(m_lock);
+	unsigned int total = m_hits + m_misses;
+	printf("Cache: %u hits, %u misses (%.0f%% hit rate), %u evicted, %zu entries %.1f MB of %.1f MB\n",
+		m_hits, m_misses, total ? 100.0 * m_hits / total : 0.0, m_evictions,
+		m_entries.size(), m_bytes / 1e6, m_maxBytes / 1e6);
+}
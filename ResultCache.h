@@ -0,0 +1,52 @@
+#pragma once
+#include "targaHandler.h"
+#include <stdint.h>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// class ResultCache
+//
+// Content addressed on-disk cache of resize results. An entry is
+// keyed by a hash of the input bytes together with everything that
+// changes the output (scale factors, filter, kernel, box filter,
+// compression), so resubmitting the same asset with the same settings
+// returns the stored file instead of decoding, resampling and encoding
+// again.
+// Entries are plain TGA files named <key>.tga in one directory; the
+// directory is capped at a size, least recently used entries go
+// first. Safe to use from several threads.
+class ResultCache {
+public:
+	ResultCache(const char* dir, uint64_t maxBytes);
+
+	void setHardLinks(bool enable) { m_hardLinks = enable; }
+	std::string key(const char* input, float scalex, float scaley, FILTER filter,
+	                KERNEL kernel, bool boxFilter, COMPRESSION comp);
+	bool fetch(const std::string& key, const char* output);
+	void store(const std::string& key, const char* output);
+	unsigned int hits() const { return m_hits; }
+	unsigned int misses() const { return m_misses; }
+	void printReport();
+
+private:
+	typedef struct {
+		std::string name;
+		uint64_t size;
+		std::filesystem::file_time_type used;
+	} Entry;
+
+	bool place(const std::filesystem::path& from, const std::filesystem::path& to);
+	void evict();
+
+	std::filesystem::path m_dir;
+	uint64_t m_maxBytes;
+	uint64_t m_bytes;
+	bool m_hardLinks;
+	std::vector<Entry> m_entries;
+	std::mutex m_lock;
+	unsigned int m_hits;
+	unsigned int m_misses;
+	unsigned int m_evictions;
+};
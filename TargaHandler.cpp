@@ -1,4 +1,10 @@
 #include "targaHandler.h"
+#include "FileMapping.h"
+#include "Metrics.h"
+#include <emmintrin.h>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
 // Default constructor
 //
 // TargaHandler uses MemoryManager to pre-allocate
@@ -10,22 +16,33 @@ TargaHandler::TargaHandler() {
 	// is then 1:1 - i.e same as using malloc here.
 	// (For more info, see class 'MemoryManager')
 	m_runsExpected = 0;
+	m_kernel = SEPARABLE;
+	m_pool = NULL;
+	m_mapFiles = false;
+	m_boxFilter = true;
+	m_filter = BILINEAR;
+	m_tileWidth = 0;
+	m_tileHeight = 0;
+	m_padded = false;
+	m_verbose = true;
 }
 
 // Destructor
 //
-// Because TargaHandler anticipates multiple runs, 
-// it also uses a dedicated MemoryManager for each 
-// new image-resolution - each needs deletion. 
+// Frees the handler's own tables. The memory pools are shared by
+// every handler and belong to the process (see releaseMemoryPools),
+// so Images a handler allocated stay valid after it is destroyed.
 TargaHandler::~TargaHandler() {
-
-	for (auto const& p : g_MemoryMap) {
-		MemoryManager* toDelete = p.second;
-		delete toDelete;
-		// Note: deleting MemoryManagers launches 
-		// MemoryManager::cleanUp() method ensuring
-		// all data is freed.
+	for (auto const& t : m_tableMap) {
+		delete t.second;
+	}
+	for (auto const& t : m_filterMap) {
+		delete t.second;
 	}
+	for (auto const& t : m_fixedMap) {
+		delete t.second;
+	}
+	delete m_pool;
 }
 
 // setExpectedRuns
@@ -39,6 +56,131 @@ void TargaHandler::setExpectedRuns(unsigned int runs) {
 	m_runsExpected = runs;
 }
 
+// setKernel
+//
+// Selects the inner loop used by ResampleBillinear. SEPARABLE is 
+// the default, SCALAR is kept as the reference implementation.
+// FIXED is bilinear in 8.8 fixed point, rounded to nearest instead
+// of truncated, see resampleFixed; it runs in row bands, -tile is
+// ignored.
+//
+// @param kernel - SCALAR, SIMD, SEPARABLE or FIXED
+void TargaHandler::setKernel(KERNEL kernel) {
+	m_kernel = kernel;
+}
+
+// setFilter
+//
+// Reconstruction filter of ResampleBillinear and friends. BICUBIC 
+// and LANCZOS3 are separable, widen with the reduction factor on 
+// downscale and replace the box kernel. Ignored by the SCALAR
+// kernel and by resizeStreaming, which stay bilinear.
+//
+// @param filter - BILINEAR (default), BICUBIC or LANCZOS3
+void TargaHandler::setFilter(FILTER filter) {
+	m_filter = filter;
+}
+
+// setTileSize
+//
+// Runs the SEPARABLE bilinear kernel over width x height destination
+// tiles (see resampleTiles) instead of full width row bands. Width 
+// is capped at TILE_MAX_WIDTH, 0 turns tiling off (the default).
+// The output does not depend on the tile size.
+//
+// @param width, height - tile size in destination pixels
+void TargaHandler::setTileSize(int width, int height) {
+	if (width > TILE_MAX_WIDTH) width = TILE_MAX_WIDTH;
+	m_tileWidth = (width > 0 && height > 0) ? width : 0;
+	m_tileHeight = (width > 0 && height > 0) ? height : 0;
+}
+
+// setPaddedLayout
+//
+// Stores 24 bit images as 4 byte BGRX pixels from loadTGA until they
+// are written (see padImage), so the resample kernels run their 32 
+// bit, one-lane-per-pixel variants. Memory mapped inputs are copied.
+//
+// @param enable - pad 24 bit images on load
+void TargaHandler::setPaddedLayout(bool enable) {
+	m_padded = enable;
+}
+
+// setBoxFilter
+//
+// Scales that are exact reciprocals of integers (0.5, 0.25, 1/3 ...)
+// are resampled by averaging whole NxM source blocks instead of the
+// bilinear kernel. On by default; turning it off gives bilinear 
+// output for every scale. The SCALAR kernel is never replaced.
+//
+// @param enable - use the box kernel where the scale allows it
+void TargaHandler::setBoxFilter(bool enable) {
+	m_boxFilter = enable;
+}
+
+// setThreadCount
+//
+// Number of threads ResampleBillinear splits its destination rows 
+// over. The pool is created here and reused for every later call, 
+// 1 (the default) resamples on the calling thread only and 0 uses
+// one thread per hardware core. The SCALAR kernel always runs 
+// single threaded.
+//
+// @param threads - number of threads, including the caller
+void TargaHandler::setThreadCount(unsigned int threads) {
+	if (threads == 0) threads = std::thread::hardware_concurrency();
+	delete m_pool;
+	m_pool = NULL;
+	// the calling thread takes part in the work, so spawn one less
+	if (threads > 1) m_pool = new ThreadPool(threads - 1);
+}
+
+// setMemoryMapping
+//
+// When enabled, uncompressed images are not read into a pool buffer
+// but mapped, Image::data then points into the mapped file. 
+// The mapping is released when the image data is replaced by 
+// ResampleBillinear or written by saveTGA.
+//
+// @param enable - map uncompressed inputs instead of reading them
+void TargaHandler::setMemoryMapping(bool enable) {
+	m_mapFiles = enable;
+}
+
+// setVerbose
+//
+// Turns the progress messages of loadTGA on or off, errors are
+// always printed.
+void TargaHandler::setVerbose(bool verbose) {
+	m_verbose = verbose;
+}
+
+// freeImage
+//
+// Returns the pixel data of an image that is not going to be saved
+// (or was loaded only to be inspected) to where it came from.
+void TargaHandler::freeImage(Image* img) {
+	if (img->data != NULL) releaseData(img);
+	img->data = NULL;
+}
+
+// printMemoryStats
+//
+// Prints reuse of every pool size class and of the scratch arena,
+// i.e. how often a request was served without new memory.
+void TargaHandler::printMemoryStats() {
+	std::vector<PoolStats> stats;
+	getPoolStats(stats);
+	printf("Memory pools:\n");
+	for (auto const& p : stats) {
+		unsigned int total = p.hits + p.misses;
+		printf("  class %10u bytes: %6u hits %6u misses %4u expansions (%3.0f%% reuse)\n",
+			p.classSize, p.hits, p.misses, p.expansions, total ? 100.0 * p.hits / total : 0.0);
+	}
+	printf("Scratch arena: %u allocations, %u overflows, %zu bytes block, %zu bytes peak\n",
+		m_scratch.allocations(), m_scratch.overflows(), m_scratch.capacity(), m_scratch.peak());
+}
+
 // loadTGA
 //
 // Loads either RLE or Uncompressed 24 or 32 bit targa 
@@ -53,40 +195,116 @@ bool TargaHandler::loadTGA(const char *filename, Image* img) {
 	}
 	// Store header data in member m_header from stream associated to filePtr 
 	readHeader(filePtr);
-	// only allow for 24, 32 bit
-	if ((m_header.width <= 0) || (m_header.height <= 0)
-		|| ((m_header.bitCount != 24) && (m_header.bitCount != 32))) {
-		printf("Invalid data format\n");
-		if (filePtr != NULL) fclose(filePtr);
+	if (!imageFromHeader(img)) {
+		fclose(filePtr);
 		return false;
 	}
 
-	// pass relevant data to Image struct
-	img->width = m_header.width;
-	img->height = m_header.height;
-	img->bpp = ((short int)m_header.bitCount / 8);
-	img->imageSize = (img->bpp * img->width * img->height);
+	// bit 5 of the descriptor set means the first row is the top one,
+	// anything else is flipped while loading
+	bool bottomUp = (m_header.imagedescriptor & 0x20) == 0;
 
 	// determine read method
 	bool success = false;
 	// Uncompressed 
 	if (m_header.datatypecode == 2) { 
-		printf("Uncompressed file loading\n");
-		success = loadUncompressed(filename, img, filePtr);
-		if (!success) printf("Uncompressed file loaded\n");
+		if (m_verbose) printf("Uncompressed file loading\n");
+		// a mapping can only be used as is, bottom-up files are read
+		if (m_mapFiles && !bottomUp) {
+			fclose(filePtr);
+			success = loadMapped(filename, img);
+		}
+		else success = loadUncompressed(filename, img, filePtr, bottomUp);
+		if (!success) printf("Failed loading Uncompressed file\n");
 	} 
 	// Compressed
 	else if (m_header.datatypecode == 10) { 
-		printf("RLE compressed file loading\n");
-		success = loadCompressed(filename, img, filePtr);
+		if (m_verbose) printf("RLE compressed file loading\n");
+		success = loadCompressed(filename, img, filePtr, bottomUp);
 		if (!success) printf("Failed loading Compressed file\n");
 	}
 	else {
 		printf("File format not supported\n");
 	}
+	if (success && m_padded && img->bpp == 3)
+		padImage(img);
 	return success;
 }
 
+// imageFromHeader
+//
+// Checks m_header (only 24 and 32 bit) and passes its size to img, 
+// without pixel data yet.
+//
+// @return false for an unsupported format
+bool TargaHandler::imageFromHeader(Image* img) {
+	// only allow for 24, 32 bit
+	if ((m_header.width <= 0) || (m_header.height <= 0)
+		|| ((m_header.bitCount != 24) && (m_header.bitCount != 32))) {
+		printf("Invalid data format\n");
+		return false;
+	}
+
+	// pass relevant data to Image struct
+	img->data = NULL;
+	img->mapBase = NULL;
+	img->mapLength = 0;
+	img->padded = false;
+	img->width = m_header.width;
+	img->height = m_header.height;
+	img->bpp = ((short int)m_header.bitCount / 8);
+	img->imageSize = (img->bpp * img->width * img->height);
+	return true;
+}
+
+// padPixels
+//
+// BGR -> BGRX, the fourth byte is zero. Reads 4 bytes per pixel, so
+// the last pixel is copied on its own.
+static void padPixels(const unsigned char* src, unsigned char* dst, size_t count) {
+	if (count == 0) return;
+	for (size_t i = 0; i + 1 < count; i++) {
+		uint32_t v;
+		memcpy(&v, src + i * 3, 4);
+		v &= 0x00FFFFFF;
+		memcpy(dst + i * 4, &v, 4);
+	}
+	size_t last = count - 1;
+	memcpy(dst + last * 4, src + last * 3, 3);
+	dst[last * 4 + 3] = 0;
+}
+
+// packPixels
+//
+// BGRX -> BGR. Writes 4 bytes per pixel, each overlapping the next,
+// so again the last pixel is copied on its own.
+static void packPixels(const unsigned char* src, unsigned char* dst, size_t count) {
+	if (count == 0) return;
+	for (size_t i = 0; i + 1 < count; i++)
+		memcpy(dst + i * 3, src + i * 4, 4);
+	size_t last = count - 1;
+	memcpy(dst + last * 3, src + last * 4, 3);
+}
+
+// padImage
+//
+// Converts a loaded 24 bit image to the padded layout: 4 bytes per
+// pixel in a new pool buffer, so every pixel is one aligned 32 bit
+// lane and rows of width % 4 == 0 start on 16 byte boundaries. The
+// image then behaves as 32 bit (bpp 4) until it is written, where
+// writeTGA packs it back to 24 bit.
+void TargaHandler::padImage(Image* img) {
+	const size_t count = static_cast<size_t>(img->width) * img->height;
+	const int paddedSize = static_cast<int>(count * 4);
+	unsigned char* padded = newMemory<unsigned char>(paddedSize, m_runsExpected);
+	padPixels(img->data, padded, count);
+	releaseData(img);
+	img->data = padded;
+	img->bpp = 4;
+	img->imageSize = paddedSize;
+	img->padded = true;
+}
+
 // loadUncompressed
 //
 // Uncompressed TGA procedure for images of either 24 or 32 bit
@@ -95,38 +313,88 @@ bool TargaHandler::loadTGA(const char *filename, Image* img) {
 // @param filename - name of input file
 // @param img - structure to hold the pixel data
 // @param filePtr - pointer to file on disk
+// @param bottomUp - the file stores the bottom row first, rows
+//                   are read into top-down order
 //
 // @return Returns false if either allocation of memory or 
 //         data-read fails. 
-bool TargaHandler::loadUncompressed(const char * filename, Image* img, FILE * filePtr) {
+bool TargaHandler::loadUncompressed(const char * filename, Image* img, FILE * filePtr, bool bottomUp) {
 	img->data = newMemory<unsigned char>(img->imageSize, m_runsExpected);
 
 	if (img->data == NULL) {
 		printf("Could not allocating memory for uncompressed image\n");
 		return false;
 	}
-	// read data
-	if (fread(img->data, 1, img->imageSize, filePtr) != img->imageSize) {
-		printf("Error reading uncompressed data\n");
-		return false;
+	// skip the image ID field following the header
+	fseek(filePtr, (unsigned char)m_header.idlength, SEEK_CUR);
+	// read data, bottom-up files a row at a time into flipped rows
+	{
+		METRICS_SCOPE(STAGE_READ);
+		bool complete = true;
+		if (bottomUp) {
+			const size_t rowBytes = static_cast<size_t>(img->width) * img->bpp;
+			for (int y = img->height - 1; y >= 0 && complete; y--)
+				complete = fread(img->data + y * rowBytes, 1, rowBytes, filePtr) == rowBytes;
+		}
+		else complete = fread(img->data, 1, img->imageSize, filePtr) == img->imageSize;
+		if (!complete) {
+			printf("Error reading uncompressed data\n");
+			return false;
+		}
 	}
+	METRICS_ADD(BYTES_READ, img->imageSize);
 	fclose(filePtr);
 
 	return true;
 }
 
+// loadMapped
+//
+// Zero-copy variant of loadUncompressed. The file is mapped read-only
+// and img->data is pointed at the pixels following the 18 byte header
+// and the image ID field. 
+//
+// @param filename - name of input file
+// @param img - structure to hold the pixel data
+//
+// @return Returns false if mapping fails or the file is too short
+bool TargaHandler::loadMapped(const char * filename, Image* img) {
+	METRICS_SCOPE(STAGE_READ);
+	size_t length = 0;
+	unsigned char* base = mapFile(filename, &length);
+	if (base == NULL) {
+		printf("Could not map uncompressed image\n");
+		return false;
+	}
+	size_t offset = 18 + (unsigned char)m_header.idlength;
+	if (length < offset + img->imageSize) {
+		printf("Error reading uncompressed data\n");
+		unmapFile(base, length);
+		return false;
+	}
+	img->mapBase = base;
+	img->mapLength = length;
+	img->data = base + offset;
+	METRICS_ADD(BYTES_READ, img->imageSize);
+	return true;
+}
+
 // loadCompressed
 //
 // RLE compressed TGA procedure for images of either 24 or 32 
-// bit and uses MemoryManager for memory allocation. 
+// bit and uses MemoryManager for memory allocation. The packet 
+// stream is read in one go (or mapped, see setMemoryMapping) and 
+// expanded from memory by decodeRLE.
 // 
 // @param filename - name of input file
 // @param img - structure to hold the pixel data
 // @param filePtr - pointer to file on disk
+// @param bottomUp - the file stores the bottom row first, decoded
+//                   pixels are placed in top-down order
 //
 // @return Returns false if either allocation of memory or 
 //         data-read fails. 
-bool TargaHandler::loadCompressed(const char * filename, Image* img, FILE * filePtr) {
+bool TargaHandler::loadCompressed(const char * filename, Image* img, FILE * filePtr, bool bottomUp) {
 	// Allocate Memory To Store Image Data
 	img->data = newMemory<unsigned char>(img->imageSize, m_runsExpected);
 
@@ -135,60 +403,324 @@ bool TargaHandler::loadCompressed(const char * filename, Image* img, FILE * file
 		return false;
 	}
 
-	unsigned int nrOfPixels = img->height * img->width;
+	// the packets start after the header and the image ID field
+	long start = 18 + (unsigned char)m_header.idlength;
+	fseek(filePtr, 0, SEEK_END);
+	long end = ftell(filePtr);
+	size_t payloadSize = (end > start) ? static_cast<size_t>(end - start) : 0;
+	bool success = false;
+
+	if (m_mapFiles) {
+		fclose(filePtr);
+		size_t length = 0;
+		unsigned char* base = mapFile(filename, &length);
+		if (base == NULL) {
+			printf("Could not map compressed image\n");
+			freeMemory(&img->data[0], img->imageSize);
+			return false;
+		}
+		METRICS_ADD(BYTES_READ, payloadSize);
+		success = decodePackets(base + start, payloadSize, img, bottomUp);
+		unmapFile(base, length);
+	}
+	else {
+		// a one byte payload keeps the pool key valid for empty streams
+		size_t buffSize = (payloadSize > 0) ? payloadSize : 1;
+		unsigned char* payload = newMemory<unsigned char>(buffSize, m_runsExpected);
+		fseek(filePtr, start, SEEK_SET);
+		size_t readBytes;
+		{
+			METRICS_SCOPE(STAGE_READ);
+			readBytes = fread(payload, 1, payloadSize, filePtr);
+		}
+		METRICS_ADD(BYTES_READ, readBytes);
+		fclose(filePtr);
+		success = decodePackets(payload, readBytes, img, bottomUp);
+		freeMemory(payload, buffSize);
+	}
+
+	if (!success) {
+		freeMemory(&img->data[0], img->imageSize);
+		img->data = NULL;
+	}
+	return success;
+}
+
+// decodePackets
+//
+// Runs the decodeRLE matching the pixel size and origin of img.
+bool TargaHandler::decodePackets(const unsigned char* src, size_t srcLen, Image* img, bool bottomUp) {
+	// pick the decoder for this pixel size and origin once
+	typedef bool (TargaHandler::*Decoder)(const unsigned char*, size_t, unsigned char*, int, int);
+	Decoder decode;
+	if (m_pool != NULL && img->width * img->height >= 2 * RLE_MIN_SEGMENT) {
+		// large images are expanded on all threads
+		if (img->bpp == 4) decode = bottomUp ? &TargaHandler::decodeRLEParallel<4, true> : &TargaHandler::decodeRLEParallel<4, false>;
+		else decode = bottomUp ? &TargaHandler::decodeRLEParallel<3, true> : &TargaHandler::decodeRLEParallel<3, false>;
+	}
+	else if (img->bpp == 4) decode = bottomUp ? &TargaHandler::decodeRLE<4, true> : &TargaHandler::decodeRLE<4, false>;
+	else decode = bottomUp ? &TargaHandler::decodeRLE<3, true> : &TargaHandler::decodeRLE<3, false>;
+	if (!(this->*decode)(src, srcLen, img->data, img->width, img->height))
+		return false;
+	METRICS_ADD(PIXELS_DECODED, img->width * img->height);
+	return true;
+}
+
+// beginLoad
+//
+// First half of a load whose file I/O is done by the caller. Parses
+// the header, allocates the image and tells where the rest of the
+// file has to be read to: top-down uncompressed pixels go straight
+// into img->data, bottom-up pixels and RLE packets into a separate
+// pool buffer.
+//
+// @param header - the first 18 bytes of the file
+// @param fileSize - size of the whole file
+// @param load - receives the read to do before finishLoad
+//
+// @return false for unsupported files or if memory cannot be
+//         allocated, nothing is left allocated then
+bool TargaHandler::beginLoad(const unsigned char* header, size_t fileSize, Image* img, PendingLoad* load) {
+	parseHeader(header);
+	if (!imageFromHeader(img))
+		return false;
+	if (m_header.datatypecode != 2 && m_header.datatypecode != 10) {
+		printf("File format not supported\n");
+		return false;
+	}
+	load->offset = 18 + (unsigned char)m_header.idlength;
+	load->rle = (m_header.datatypecode == 10);
+	if (m_verbose) printf(load->rle ? "RLE compressed file loading\n" : "Uncompressed file loading\n");
+	load->bottomUp = (m_header.imagedescriptor & 0x20) == 0;
+	const char* kind = load->rle ? "compressed" : "uncompressed";
+	img->data = newMemory<unsigned char>(img->imageSize, m_runsExpected);
+	if (img->data == NULL) {
+		printf("Could not allocating memory for %s image\n", kind);
+		return false;
+	}
+	if (load->rle) {
+		load->length = (fileSize > load->offset) ? fileSize - load->offset : 0;
+		// a one byte payload keeps the pool key valid for empty streams
+		load->bufferSize = (load->length > 0) ? load->length : 1;
+		load->buffer = newMemory<unsigned char>(load->bufferSize, m_runsExpected);
+	}
+	else {
+		load->length = img->imageSize;
+		load->bufferSize = img->imageSize;
+		load->buffer = load->bottomUp ? newMemory<unsigned char>(load->bufferSize, m_runsExpected) : img->data;
+	}
+	if (load->buffer == NULL) {
+		printf("Could not allocating memory for %s data\n", kind);
+		freeMemory(&img->data[0], img->imageSize);
+		img->data = NULL;
+		return false;
+	}
+	return true;
+}
+
+// finishLoad
+//
+// Second half of beginLoad, once bytesRead bytes of the requested
+// range are in load->buffer. Decodes or flips into img->data and
+// frees the intermediate buffer; errors are reported as loadTGA 
+// would and leave img without data.
+bool TargaHandler::finishLoad(Image* img, PendingLoad* load, size_t bytesRead) {
+	METRICS_ADD(BYTES_READ, 18 + bytesRead);
+	bool success;
+	if (load->rle) {
+		success = decodePackets(load->buffer, bytesRead, img, load->bottomUp);
+		if (!success) printf("Failed loading Compressed file\n");
+	}
+	else {
+		success = bytesRead == load->length;
+		if (!success) printf("Error reading uncompressed data\nFailed loading Uncompressed file\n");
+		else if (load->bottomUp) {
+			const size_t rowBytes = static_cast<size_t>(img->width) * img->bpp;
+			for (int y = 0; y < img->height; y++)
+				memcpy(img->data + (img->height - 1 - y) * rowBytes, load->buffer + y * rowBytes, rowBytes);
+		}
+	}
+	if (load->buffer != img->data) freeMemory(load->buffer, load->bufferSize);
+	load->buffer = NULL;
+	if (!success) {
+		freeMemory(&img->data[0], img->imageSize);
+		img->data = NULL;
+		return false;
+	}
+	if (m_padded && img->bpp == 3)
+		padImage(img);
+	return true;
+}
+
+// fillPixels
+//
+// Writes 'count' copies of one pixel. The first copy is stored 
+// directly, after that the already written part is copied onto
+// the rest, doubling in size each time.
+template<int BPP>
+static inline void fillPixels(unsigned char* dst, const unsigned char* pixel, unsigned int count) {
+	size_t total = static_cast<size_t>(count) * BPP;
+	memcpy(dst, pixel, BPP);
+	size_t filled = BPP;
+	while (filled < total) {
+		size_t chunk = (filled < total - filled) ? filled : total - filled;
+		memcpy(dst + filled, dst, chunk);
+		filled += chunk;
+	}
+}
+
+// expandPacket
+//
+// Writes the pixels of one packet, no checks. For BOTTOM_UP streams
+// the packet is split at row ends and every piece goes to its flipped
+// row; row and col are the stream position and move along.
+//
+// @param in - packet data following the header byte
+// @param pixIdx - first pixel of the packet in stream order
+template<int BPP, bool BOTTOM_UP>
+static inline void expandPacket(const unsigned char* in, bool raw, unsigned int count, unsigned char* dst,
+                                unsigned int pixIdx, unsigned int& row, unsigned int& col, int width, int height) {
+	if (!BOTTOM_UP) {
+		unsigned char* out = dst + static_cast<size_t>(pixIdx) * BPP;
+		if (raw) memcpy(out, in, static_cast<size_t>(count) * BPP);
+		else fillPixels<BPP>(out, in, count);
+		return;
+	}
+	const size_t rowBytes = static_cast<size_t>(width) * BPP;
+	for (unsigned int left = count; left > 0; ) {
+		unsigned int chunk = (left < width - col) ? left : width - col;
+		unsigned char* out = dst + (height - 1 - row) * rowBytes + col * BPP;
+		if (raw) {
+			memcpy(out, in, chunk * BPP);
+			in += chunk * BPP;
+		}
+		else fillPixels<BPP>(out, in, chunk);
+		left -= chunk;
+		col += chunk;
+		if (col == static_cast<unsigned int>(width)) { col = 0; row++; }
+	}
+}
+
+// decodeRLE
+//
+// Expands a TGA RLE packet stream held in memory. Raw packets are 
+// copied with a single memcpy, run packets with fillPixels. A packet
+// that would run past the last pixel, or a stream that ends before
+// all pixels are decoded, is an error. For BOTTOM_UP streams (first
+// row in the file is the bottom one) packets are split at row ends
+// and every row is written to its flipped position, so the image
+// comes out top-down without a separate pass.
+//
+// @param src - packet stream
+// @param srcLen - bytes available in src
+// @param dst - output, width * height * BPP bytes
+//
+// @return false on corrupt or truncated data
+template<int BPP, bool BOTTOM_UP>
+bool TargaHandler::decodeRLE(const unsigned char* src, size_t srcLen, unsigned char* dst,
+                             int width, int height) {
+	METRICS_SCOPE(STAGE_DECODE);
+	const unsigned int nrOfPixels = static_cast<unsigned int>(width) * height;
+	size_t srcIdx = 0;
 	unsigned int pixIdx = 0;
-	unsigned int buffIdx = 0;
-	unsigned char* pBuff = newMemory<unsigned char>(img->bpp, m_runsExpected);
+	unsigned int row = 0, col = 0;
 
 	while (pixIdx < nrOfPixels) {
-		// headerInfo - storage for the ID header (RAW or RLE)
-		unsigned char headerInfo = 0; 
-		if (fread(&headerInfo, sizeof(unsigned char), 1, filePtr) == 0) {
-			// Read in the 1 byte header
+		if (srcIdx >= srcLen) {
 			printf("Could not read header\n");
-			closeAndFree(img, filePtr);
 			return false;
 		}
+		// headerInfo - storage for the ID header (RAW or RLE)
+		unsigned char headerInfo = src[srcIdx++];
+		// low 7 bits hold the pixel count - 1 for both packet types
+		unsigned int count = (headerInfo & 127) + 1;
+		if (count > nrOfPixels - pixIdx) {
+			printf("Out of bounds when readign pixel data!\n");
+			return false;
+		}
+		// header < 128 = RAW, ELSE = RLE
+		size_t packetBytes = (headerInfo < 128) ? count * BPP : BPP;
+		if (packetBytes > srcLen - srcIdx) {
+			printf("Could not read image data\n");
+			return false;
+		}
+		expandPacket<BPP, BOTTOM_UP>(src + srcIdx, headerInfo < 128, count, dst, pixIdx, row, col, width, height);
+		srcIdx += packetBytes;
+		pixIdx += count;
+	}
+	return true;
+}
 
-		if (headerInfo < 128) { // header < 128 = RAW, ELSE = RLE
-			// next byte, number of consecutive RAW
-			headerInfo += 1;
-			for (int i = 0; i < headerInfo; i++) {
-				// headerInfo - now contains nr of RAW color values -> loop
-				// try get each unique pixel
-				if (!readPixel(pBuff, img, filePtr)) 
-					return false;
-				storePixel(img, pBuff, buffIdx);
-				buffIdx += img->bpp;
-				pixIdx++;
+// RleCheckpoint
+//
+// Position in a packet stream at a packet boundary, and the pixel
+// (in stream order) the packet there starts at.
+typedef struct {
+	size_t src;
+	unsigned int pixel;
+} RleCheckpoint;
 
-				if (pixIdx > nrOfPixels) {
-					printf("Out of bounds when readign pixel data!\n");
-					closeAndFree(img, filePtr, pBuff);
-					return false;
-				}
-			}
-		}else { // headerInfo > 128, RLE data, next color reapeated maximum 127 times
-			// remove high bit (128) to get repeat count
-			headerInfo -= 127;
-			// Get the next 3 bytes, which should be the values to duplicate.
-			if (!readPixel(pBuff, img, filePtr))   
-				return false;
-			// copy the color into the image data as many times as dictated by headerInfo
-			for (int i = 0; i < headerInfo; i++) {	
-				storePixel(img, pBuff, buffIdx);
-				buffIdx += img->bpp;
-				pixIdx++;
-
-				if (pixIdx > nrOfPixels) {
-					printf("Out of bounds when readign pixel data!\n");
-					closeAndFree(img, filePtr, pBuff);
-					return false;
-				}
-			}
+// decodeRLEParallel
+//
+// decodeRLE in two passes. A sequential scan walks only the packet
+// headers, checking them exactly as decodeRLE does (same messages,
+// same outcome), and records a checkpoint about every 1/(4 * threads)
+// of the image. Workers then expand the segments between checkpoints
+// into dst at the same time; segments are whole packets, so no packet
+// is split between workers. Corrupt streams fail in the scan, before
+// anything is written.
+template<int BPP, bool BOTTOM_UP>
+bool TargaHandler::decodeRLEParallel(const unsigned char* src, size_t srcLen, unsigned char* dst,
+                                     int width, int height) {
+	METRICS_SCOPE(STAGE_DECODE);
+	const unsigned int nrOfPixels = static_cast<unsigned int>(width) * height;
+	unsigned int step = nrOfPixels / ((m_pool->size() + 1) * 4);
+	if (step < RLE_MIN_SEGMENT) step = RLE_MIN_SEGMENT;
+
+	std::vector<RleCheckpoint> marks;
+	marks.push_back(RleCheckpoint{ 0, 0 });
+	unsigned int nextMark = step;
+	size_t srcIdx = 0;
+	unsigned int pixIdx = 0;
+	while (pixIdx < nrOfPixels) {
+		if (pixIdx >= nextMark) {
+			marks.push_back(RleCheckpoint{ srcIdx, pixIdx });
+			nextMark = pixIdx + step;
+		}
+		if (srcIdx >= srcLen) {
+			printf("Could not read header\n");
+			return false;
 		}
+		unsigned char headerInfo = src[srcIdx++];
+		unsigned int count = (headerInfo & 127) + 1;
+		if (count > nrOfPixels - pixIdx) {
+			printf("Out of bounds when readign pixel data!\n");
+			return false;
+		}
+		size_t packetBytes = (headerInfo < 128) ? count * BPP : BPP;
+		if (packetBytes > srcLen - srcIdx) {
+			printf("Could not read image data\n");
+			return false;
+		}
+		srcIdx += packetBytes;
+		pixIdx += count;
 	}
+	marks.push_back(RleCheckpoint{ srcIdx, nrOfPixels });
 
+	auto segment = [&](int i) {
+		size_t s = marks[i].src;
+		unsigned int pix = marks[i].pixel;
+		const unsigned int end = marks[i + 1].pixel;
+		unsigned int row = pix / width, col = pix % width;
+		while (pix < end) {
+			unsigned char headerInfo = src[s++];
+			unsigned int count = (headerInfo & 127) + 1;
+			expandPacket<BPP, BOTTOM_UP>(src + s, headerInfo < 128, count, dst, pix, row, col, width, height);
+			s += (headerInfo < 128) ? count * BPP : BPP;
+			pix += count;
+		}
+	};
+	m_pool->parallelFor(static_cast<int>(marks.size()) - 1, segment);
 	return true;
 }
 
@@ -218,13 +750,184 @@ unsigned char TargaHandler::getPixelVal(Image* img, int x, int y, int i) {
 void TargaHandler::ResampleBillinear(Image *img, float scalex, float scaley) {
 	int newWidth  = static_cast<int>(img->width * scalex);
 	int newHeight = static_cast<int>(img->height * scaley);
-	int x, y, ui, vi;
-	float u, v;
-	unsigned char p00, p10, p01, p11;
+	Image out;
+	resampleInto(img, &out, newWidth, newHeight, boxFactor(scalex), boxFactor(scaley));
 
+	// Original data will replaced, free
+	releaseData(img);
+
+	// re-point to the new data
+	*img = out;
+}
+
+// resampleToSize
+//
+// Like ResampleBillinear, for a destination size instead of scale
+// factors. The box kernel is used when the size is what a 1/N scale
+// would give for integer N (e.g. 97 -> 48 for N = 2).
+//
+// @param img - image pixel container, replaced by the result
+// @param newWidth, newHeight - destination size
+void TargaHandler::resampleToSize(Image* img, int newWidth, int newHeight) {
+	Image out;
+	resampleInto(img, &out, newWidth, newHeight,
+	             sizeFactor(img->width, newWidth), sizeFactor(img->height, newHeight));
+	releaseData(img);
+	*img = out;
+}
+
+// sizeFactor
+//
+// N if newSize is what scaling size by 1/N gives, 0 otherwise.
+int TargaHandler::sizeFactor(int size, int newSize) {
+	if (newSize <= 0 || newSize > size) return 0;
+	int n = size / newSize;
+	return (size / n == newSize) ? n : 0;
+}
+
+// resizeMulti
+//
+// Decodes input once and writes every target from it. Targets are 
+// produced largest first, each from the smallest image made so far
+// that still covers it, so a 1/2, 1/4, 1/8 chain builds every level
+// from the previous one. Each result is written by a task on the 
+// thread pool while the next one is resampled (inline without a 
+// pool), so RLE encoding inside writeTGA shares the pool's threads
+// instead of adding one per target; all are released at the end.
+//
+// @param input - TGA to read
+// @param targets - output files and sizes
+// @param comp - compression of the outputs
+//
+// @return false if the input cannot be read or any output fails
+bool TargaHandler::resizeMulti(const char* input, const std::vector<ResizeTarget>& targets, COMPRESSION comp) {
+	Image src;
+	if (!loadTGA(input, &src))
+		return false;
+
+	const size_t n = targets.size();
+	std::vector<int> width(n), height(n);
+	std::vector<size_t> order;
+	bool success = true;
+	for (size_t i = 0; i < n; i++) {
+		const ResizeTarget& t = targets[i];
+		if (t.fit > 0) {
+			bool wide = src.width >= src.height;
+			width[i] = wide ? t.fit : static_cast<int>(static_cast<int64_t>(src.width) * t.fit / src.height);
+			height[i] = wide ? static_cast<int>(static_cast<int64_t>(src.height) * t.fit / src.width) : t.fit;
+		}
+		else if (t.width > 0 || t.height > 0) {
+			width[i] = (t.width > 0) ? t.width : static_cast<int>(static_cast<int64_t>(src.width) * t.height / src.height);
+			height[i] = (t.height > 0) ? t.height : static_cast<int>(static_cast<int64_t>(src.height) * t.width / src.width);
+		}
+		else {
+			width[i] = static_cast<int>(src.width * t.scale);
+			height[i] = static_cast<int>(src.height * t.scale);
+		}
+		if (width[i] <= 0 || height[i] <= 0) {
+			printf("Scaling results in an empty image: \"%s\"\n", t.filename.c_str());
+			success = false;
+		}
+		else order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return static_cast<int64_t>(width[a]) * height[a] > static_cast<int64_t>(width[b]) * height[b];
+	});
+
+	std::vector<Image> images(n);
+	std::vector<char> owned(n, 0), written(n, 1);
+	std::atomic<int> writing(0);
+	for (size_t k = 0; k < order.size(); k++) {
+		size_t i = order[k];
+		Image* from = &src;
+		for (size_t j = 0; j < k; j++) {
+			Image* level = &images[order[j]];
+			if (level->width >= width[i] && level->height >= height[i]
+				&& level->imageSize < from->imageSize) from = level;
+		}
+		if (from->width == width[i] && from->height == height[i]) {
+			images[i] = *from;
+		}
+		else {
+			resampleInto(from, &images[i], width[i], height[i],
+			             sizeFactor(from->width, width[i]), sizeFactor(from->height, height[i]));
+			owned[i] = 1;
+		}
+		if (m_pool == NULL) {
+			written[i] = writeTGA(targets[i].filename.c_str(), &images[i], comp);
+			continue;
+		}
+		writing++;
+		m_pool->submit([&, i] {
+			written[i] = writeTGA(targets[i].filename.c_str(), &images[i], comp);
+			writing--;
+		});
+	}
+	if (m_pool != NULL) m_pool->helpUntil([&writing]() { return writing == 0; });
+
+	for (size_t i = 0; i < n; i++) {
+		if (owned[i]) releaseData(&images[i]);
+		if (!written[i]) success = false;
+	}
+	releaseData(&src);
+	return success;
+}
+
+// resampleInto
+//
+// Resamples img into newly allocated out, leaving img untouched.
+// fx and fy are the integer reduction factors for the box kernel,
+// 0 when the geometry is not an exact 1/N reduction.
+void TargaHandler::resampleInto(Image* img, Image* out, int newWidth, int newHeight, int fx, int fy) {
+	METRICS_SCOPE(STAGE_RESAMPLE);
 	int newSize = newWidth * newHeight * img->bpp;
 	unsigned char* newData = newMemory<unsigned char>(newSize, m_runsExpected);
-	int* bgr = newMemory<int>(img->bpp, m_runsExpected);
+
+	bool box = m_boxFilter && m_filter == BILINEAR && m_kernel != SCALAR && fx > 0 && fy > 0
+		&& fx * fy > 1 && fx * fy <= BOX_MAX_AREA
+		&& newWidth > 0 && newHeight > 0
+		&& newWidth * fx <= img->width && newHeight * fy <= img->height;
+
+	if (m_kernel == SCALAR)
+		resampleScalar(img, newData, newWidth, newHeight);
+	else if (m_filter != BILINEAR && img->bpp == 4)
+		resampleFiltered<4>(img, newData, newWidth, newHeight);
+	else if (m_filter != BILINEAR)
+		resampleFiltered<3>(img, newData, newWidth, newHeight);
+	else if (box && img->bpp == 4)
+		resampleBox<4>(img, newData, newWidth, newHeight, fx, fy);
+	else if (box)
+		resampleBox<3>(img, newData, newWidth, newHeight, fx, fy);
+	else if (img->bpp == 4)
+		resampleBands<4>(img, newData, newWidth, newHeight);
+	else
+		resampleBands<3>(img, newData, newWidth, newHeight);
+
+	// per-call scratch of the kernels is dropped in one go
+	m_scratch.reset();
+
+	out->data = newData;
+	out->mapBase = NULL;
+	out->mapLength = 0;
+	out->padded = img->padded;
+	out->width = newWidth;
+	out->height = newHeight;
+	out->bpp = img->bpp;
+	out->imageSize = newSize;
+	METRICS_ADD(PIXELS_RESAMPLED, newWidth * newHeight);
+}
+
+// resampleScalar
+//
+// Reference kernel for ResampleBillinear, one component at a time.
+//
+// @param img - source image
+// @param dst - destination buffer of newWidth*newHeight*bpp bytes
+void TargaHandler::resampleScalar(Image* img, unsigned char* dst, int newWidth, int newHeight) {
+	int x, y, ui, vi;
+	float u, v;
+	unsigned char p00, p10, p01, p11;
+	int* bgr = m_scratch.allocate<int>(img->bpp);
 
 	for (x = 0; x < newWidth; x++) {
 		for (y = 0; y < newHeight; y++) {
@@ -248,127 +951,1439 @@ void TargaHandler::ResampleBillinear(Image *img, float scalex, float scaley) {
 			// calculate index in the resized image
 			int destIdx = (y * (newWidth * img->bpp)) + (x * img->bpp);
 
-			newData[destIdx + 0] = bgr[0];
-			newData[destIdx + 1] = bgr[1];
-			newData[destIdx + 2] = bgr[2];
-			if (img->bpp == 4) newData[destIdx + 3] = bgr[3];		// if alpha, 32 bpp 
+			dst[destIdx + 0] = bgr[0];
+			dst[destIdx + 1] = bgr[1];
+			dst[destIdx + 2] = bgr[2];
+			if (img->bpp == 4) dst[destIdx + 3] = bgr[3];		// if alpha, 32 bpp 
 		}
 	}
-	// Original data will replaced, free
-	freeMemory(&img->data[0], img->imageSize);
-	freeMemory(&bgr[0], img->bpp);
+}
 
-	// re-point to the new data
-	img->data = newData;
-	img->width = newWidth;
-	img->height = newHeight;
-	img->imageSize = newSize;
+// loadPixelPS
+//
+// Widens one BGR(A) pixel to four float lanes, lane 3 is 
+// left at zero for 24 bit images.
+template<int BPP>
+static inline __m128 loadPixelPS(const unsigned char* p) {
+	int packed = 0;
+	memcpy(&packed, p, BPP);
+	__m128i zero = _mm_setzero_si128();
+	__m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(px, zero));
 }
-// saveTGA
+
+// lerpPS
 //
-// Determines method of compression for tga image.
-// Currently only supports uncompressed writing.
+// Same operation order as TargaHandler::lerp so that both 
+// kernels round identically.
+static inline __m128 lerpPS(__m128 s1, __m128 s2, __m128 t) {
+	return _mm_add_ps(s1, _mm_mul_ps(_mm_sub_ps(s2, s1), t));
+}
+
+// resampleSIMD
 //
-// @param filename - output file name
-// @param img - image pixel container 
-// @param comp - enum determining which compression to use
+// SSE2 kernel for ResampleBillinear. Walks the destination row by 
+// row, four pixels per iteration: sampling points are computed for 
+// four columns at once, each 2x2 neighbourhood is gathered with all
+// BGR(A) components in one register, and the four results are packed
+// back to bytes with a single saturating pack. Matches the scalar 
+// kernel within +-1 LSB (bit exact unless the compiler contracts the
+// scalar path into FMA).
 //
-// @return returns the outcome of func. saveUncompressed
-bool TargaHandler::saveTGA(const char *filename, Image* img, COMPRESSION comp) {
-	// create generic header
-	Header gHeader = { 0 };
-	gHeader.width = img->width;
-	gHeader.height = img->height;
-	gHeader.bitCount = img->bpp * 8;
-	gHeader.imagedescriptor = 32; // tb read from upper-left corner
-
-	if (comp == UNCOMPRESSED) {
-		gHeader.datatypecode = 2; // uncompressed code
-								  // write uncompressed file
-		return saveUncompressed(&gHeader, filename, img);
-	}
-	else if (comp == RLE) {
-		gHeader.datatypecode = 10; // compressed code
-								   // write compressed file
-		printf("Saving RLE-images available in next patch.\n");
-		return false;
-	}
-	else {
-		printf("Unsupported compression format\n");
-		return false;
+// @param img - source image
+// @param dst - destination buffer of newWidth*newHeight*BPP bytes
+// @param y0, y1 - band of destination rows [y0, y1) to compute
+template<int BPP>
+void TargaHandler::resampleSIMD(Image* img, unsigned char* dst, int newWidth, int newHeight, int y0, int y1) {
+	const int rowStride = img->width * BPP;
+	const __m128 newW = _mm_set1_ps((float)newWidth);
+	const __m128 srcW = _mm_set1_ps((float)(img->width - 1));
+	alignas(16) int ui[4];
+	alignas(16) float tx[4];
+	alignas(16) unsigned char packed[16];
+
+	for (int y = y0; y < y1; y++) {
+		float v = y / (float)(newHeight)*(img->height - 1);
+		int vi = (int)v;
+		const __m128 ty = _mm_set1_ps(v - vi);
+		const unsigned char* row0 = img->data + vi * rowStride;
+		const unsigned char* row1 = row0 + rowStride;
+		unsigned char* out = dst + y * newWidth * BPP;
+
+		for (int x = 0; x < newWidth; x += 4) {
+			// clamp the lanes past the row end, they are computed but not stored
+			int last = newWidth - 1;
+			__m128 xs = _mm_cvtepi32_ps(_mm_set_epi32(
+				x + 3 < last ? x + 3 : last, x + 2 < last ? x + 2 : last,
+				x + 1 < last ? x + 1 : last, x));
+			__m128 u = _mm_mul_ps(_mm_div_ps(xs, newW), srcW);
+			__m128i uInt = _mm_cvttps_epi32(u);
+			_mm_store_si128((__m128i*)ui, uInt);
+			_mm_store_ps(tx, _mm_sub_ps(u, _mm_cvtepi32_ps(uInt)));
+
+			__m128i res[4];
+			for (int k = 0; k < 4; k++) {
+				const unsigned char* p0 = row0 + ui[k] * BPP;
+				const unsigned char* p1 = row1 + ui[k] * BPP;
+				__m128 t = _mm_set1_ps(tx[k]);
+				__m128 top = lerpPS(loadPixelPS<BPP>(p0), loadPixelPS<BPP>(p0 + BPP), t);
+				__m128 bot = lerpPS(loadPixelPS<BPP>(p1), loadPixelPS<BPP>(p1 + BPP), t);
+				res[k] = _mm_cvttps_epi32(lerpPS(top, bot, ty));
+			}
+			__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(res[0], res[1]),
+			                                 _mm_packs_epi32(res[2], res[3]));
+
+			int count = (newWidth - x < 4) ? newWidth - x : 4;
+			if (BPP == 4 && count == 4) {
+				_mm_storeu_si128((__m128i*)(out + x * BPP), bytes);
+			}
+			else {
+				_mm_store_si128((__m128i*)packed, bytes);
+				for (int k = 0; k < count; k++)
+					memcpy(out + (x + k) * BPP, packed + k * 4, BPP);
+			}
+		}
+	}
+}
+// getResampleTable
+//
+// Returns the index/weight tables for a geometry, building them on
+// first use. Sampling points follow the scalar kernel exactly, so the
+// separable kernel reproduces its output.
+//
+// @return table owned by TargaHandler, valid until destruction
+const ResampleTable* TargaHandler::getResampleTable(int srcW, int srcH, int dstW, int dstH) {
+	uint64_t key = ((uint64_t)(uint16_t)srcW << 48) | ((uint64_t)(uint16_t)srcH << 32)
+	             | ((uint64_t)(uint16_t)dstW << 16) | (uint64_t)(uint16_t)dstH;
+	auto found = m_tableMap.find(key);
+	if (found != std::end(m_tableMap))
+		return found->second;
+
+	ResampleTable* table = new ResampleTable();
+	table->xIdx.resize(dstW);
+	table->xWeight.resize(dstW);
+	for (int x = 0; x < dstW; x++) {
+		float u = x / (float)(dstW)*(srcW - 1);
+		table->xIdx[x] = (int)u;
+		table->xWeight[x] = u - (int)u;
+	}
+	table->yIdx.resize(dstH);
+	table->yWeight.resize(dstH);
+	for (int y = 0; y < dstH; y++) {
+		float v = y / (float)(dstH)*(srcH - 1);
+		table->yIdx[y] = (int)v;
+		table->yWeight[y] = v - (int)v;
+	}
+	m_tableMap[key] = table;
+	return table;
+}
+
+// getFixedTable
+//
+// Returns the tables of the FIXED kernel for a geometry, building
+// them on first use. Source position x * (srcW - 1) / dstW is split
+// into index and remainder exactly, the weight is the remainder 
+// rounded half up to FIXED_BITS bits, so tables do not depend on
+// float rounding.
+//
+// @return table owned by TargaHandler, valid until destruction
+const FixedTable* TargaHandler::getFixedTable(int srcW, int srcH, int dstW, int dstH) {
+	uint64_t key = ((uint64_t)(uint16_t)srcW << 48) | ((uint64_t)(uint16_t)srcH << 32)
+	             | ((uint64_t)(uint16_t)dstW << 16) | (uint64_t)(uint16_t)dstH;
+	auto found = m_fixedMap.find(key);
+	if (found != std::end(m_fixedMap))
+		return found->second;
+
+	FixedTable* table = new FixedTable();
+	table->xIdx.resize(dstW);
+	table->xWeight.resize(dstW);
+	for (int x = 0; x < dstW; x++) {
+		int64_t pos = static_cast<int64_t>(x) * (srcW - 1);
+		table->xIdx[x] = static_cast<int>(pos / dstW);
+		table->xWeight[x] = static_cast<uint16_t>(((pos % dstW) * FIXED_ONE + dstW / 2) / dstW);
+	}
+	table->yIdx.resize(dstH);
+	table->yWeight.resize(dstH);
+	for (int y = 0; y < dstH; y++) {
+		int64_t pos = static_cast<int64_t>(y) * (srcH - 1);
+		table->yIdx[y] = static_cast<int>(pos / dstH);
+		table->yWeight[y] = static_cast<uint16_t>(((pos % dstH) * FIXED_ONE + dstH / 2) / dstH);
+	}
+	m_fixedMap[key] = table;
+	return table;
+}
+
+// horizontalPass
+//
+// Interpolates destination columns [x0, x1) of one source row, 
+// keeping the result as float so the vertical pass rounds like 
+// blerp. Column x lands at out[(x - x0) * BPP]; the output row needs
+// one float of padding for 24 bit images.
+template<int BPP>
+static void horizontalPass(const unsigned char* src, float* out, const ResampleTable* t, int srcW, int x0, int x1) {
+	out -= x0 * BPP;
+	for (int x = x0; x < x1; x++) {
+		int ui = t->xIdx[x];
+		const unsigned char* p = src + ui * BPP;
+		// the right tap has zero weight on the last column, don't read past it
+		int next = (ui + 1 < srcW) ? BPP : 0;
+		__m128 w = _mm_set1_ps(t->xWeight[x]);
+		_mm_storeu_ps(out + x * BPP, lerpPS(loadPixelPS<BPP>(p), loadPixelPS<BPP>(p + next), w));
+	}
+}
+
+// verticalPass
+//
+// Blends two horizontally resampled rows and truncates to bytes,
+// sixteen components per iteration.
+static void verticalPass(const float* r0, const float* r1, float ty, unsigned char* out, int n) {
+	const __m128 t = _mm_set1_ps(ty);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_cvttps_epi32(lerpPS(_mm_loadu_ps(r0 + i + 0), _mm_loadu_ps(r1 + i + 0), t));
+		__m128i b = _mm_cvttps_epi32(lerpPS(_mm_loadu_ps(r0 + i + 4), _mm_loadu_ps(r1 + i + 4), t));
+		__m128i c = _mm_cvttps_epi32(lerpPS(_mm_loadu_ps(r0 + i + 8), _mm_loadu_ps(r1 + i + 8), t));
+		__m128i d = _mm_cvttps_epi32(lerpPS(_mm_loadu_ps(r0 + i + 12), _mm_loadu_ps(r1 + i + 12), t));
+		_mm_storeu_si128((__m128i*)(out + i),
+			_mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+	}
+	for (; i < n; i++) {
+		out[i] = static_cast<unsigned char>(static_cast<int>(r0[i] + (r1[i] - r0[i])*ty));
+	}
+}
+
+// horizontalFixed
+//
+// horizontalPass of the FIXED kernel: p0 * (FIXED_ONE - w) + p1 * w 
+// per component, exact in 16 bits as the weights add up to 
+// FIXED_ONE. Two destination columns per iteration, one pixel pair 
+// in each 64 bit half. Column x lands at out[x * BPP]; the output row
+// needs one lane of padding for 24 bit images.
+template<int BPP>
+static void horizontalFixed(const unsigned char* src, uint16_t* out, const FixedTable* t, int srcW, int newWidth) {
+	const __m128i zero = _mm_setzero_si128();
+	for (int x = 0; x < newWidth; x += 2) {
+		// an odd last column is paired with itself
+		int xs[2] = { x, (x + 1 < newWidth) ? x + 1 : x };
+		int left[2] = { 0, 0 }, right[2] = { 0, 0 };
+		int w[2];
+		for (int k = 0; k < 2; k++) {
+			int ui = t->xIdx[xs[k]];
+			// the right tap has zero weight on the last column, don't read past it
+			int next = (ui + 1 < srcW) ? BPP : 0;
+			memcpy(&left[k], src + ui * BPP, BPP);
+			memcpy(&right[k], src + ui * BPP + next, BPP);
+			w[k] = t->xWeight[xs[k]];
+		}
+		__m128i p0 = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(left[0]), _mm_cvtsi32_si128(left[1])), zero);
+		__m128i p1 = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(right[0]), _mm_cvtsi32_si128(right[1])), zero);
+		__m128i w1 = _mm_set_epi16(w[1], w[1], w[1], w[1], w[0], w[0], w[0], w[0]);
+		__m128i w0 = _mm_sub_epi16(_mm_set1_epi16(FIXED_ONE), w1);
+		__m128i sum = _mm_add_epi16(_mm_mullo_epi16(p0, w0), _mm_mullo_epi16(p1, w1));
+		_mm_storel_epi64((__m128i*)(out + xs[0] * BPP), sum);
+		_mm_storel_epi64((__m128i*)(out + xs[1] * BPP), _mm_srli_si128(sum, 8));
+	}
+}
+
+// blendFixed
+//
+// (r0 * (FIXED_ONE - wy) + r1 * wy) of eight components as 32 bit 
+// products (mullo / mulhi halves), rounded half up and shifted back
+// to eight bits.
+static inline __m128i blendFixed(const uint16_t* r0, const uint16_t* r1, __m128i w0, __m128i w1) {
+	const __m128i half = _mm_set1_epi32(1 << (2 * FIXED_BITS - 1));
+	__m128i a = _mm_loadu_si128((const __m128i*)r0);
+	__m128i b = _mm_loadu_si128((const __m128i*)r1);
+	__m128i aLo = _mm_mullo_epi16(a, w0), aHi = _mm_mulhi_epu16(a, w0);
+	__m128i bLo = _mm_mullo_epi16(b, w1), bHi = _mm_mulhi_epu16(b, w1);
+	__m128i s0 = _mm_add_epi32(_mm_unpacklo_epi16(aLo, aHi), _mm_unpacklo_epi16(bLo, bHi));
+	__m128i s1 = _mm_add_epi32(_mm_unpackhi_epi16(aLo, aHi), _mm_unpackhi_epi16(bLo, bHi));
+	s0 = _mm_srli_epi32(_mm_add_epi32(s0, half), 2 * FIXED_BITS);
+	s1 = _mm_srli_epi32(_mm_add_epi32(s1, half), 2 * FIXED_BITS);
+	return _mm_packs_epi32(s0, s1);
+}
+
+// verticalFixed
+//
+// verticalPass of the FIXED kernel, sixteen components per iteration.
+static void verticalFixed(const uint16_t* r0, const uint16_t* r1, int wy, unsigned char* out, int n) {
+	const __m128i w0 = _mm_set1_epi16(static_cast<short>(FIXED_ONE - wy));
+	const __m128i w1 = _mm_set1_epi16(static_cast<short>(wy));
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(
+			blendFixed(r0 + i, r1 + i, w0, w1), blendFixed(r0 + i + 8, r1 + i + 8, w0, w1)));
+	}
+	const uint32_t half = 1u << (2 * FIXED_BITS - 1);
+	for (; i < n; i++) {
+		uint32_t sum = static_cast<uint32_t>(r0[i]) * (FIXED_ONE - wy) + static_cast<uint32_t>(r1[i]) * wy;
+		out[i] = static_cast<unsigned char>((sum + half) >> (2 * FIXED_BITS));
+	}
+}
+
+// resampleFixed
+//
+// FIXED kernel for ResampleBillinear, resampleSeparable in integer
+// arithmetic. Weights come from getFixedTable, once per column and
+// row. The horizontal pass keeps p0 * (1 - wx) + p1 * wx exact in 16
+// bits and the vertical pass the blend of two such rows exact in 32
+// bits, so a destination component is
+//   (sum of the four taps * wx_q * wy_q + 2^15) >> 16
+// i.e. bilinear with 8.8 weights, rounded half up, whatever the
+// instruction set or thread count. Within one LSB of exact bilinear
+// rounded to nearest.
+//
+// @param img - source image
+// @param dst - destination buffer of newWidth*newHeight*BPP bytes
+// @param t - tables from getFixedTable
+// @param y0, y1 - destination rows [y0, y1) to compute
+// @param row0, row1 - scratch rows of (newWidth*BPP + 4) lanes
+template<int BPP>
+void TargaHandler::resampleFixed(Image* img, unsigned char* dst, const FixedTable* t,
+                                 int newWidth, int y0, int y1, uint16_t* row0, uint16_t* row1) {
+	const int rowStride = img->width * BPP;
+	const int rowLen = newWidth * BPP;
+	uint16_t* rows[2] = { row0, row1 };
+	int rowId[2] = { -1, -1 };
+
+	for (int y = y0; y < y1; y++) {
+		int vi = t->yIdx[y];
+		int vn = (vi + 1 < img->height) ? vi + 1 : vi;
+		if (rowId[0] != vi) {
+			if (rowId[1] == vi) {
+				uint16_t* tmp = rows[0]; rows[0] = rows[1]; rows[1] = tmp;
+				rowId[0] = vi;
+				rowId[1] = -1;
+			}
+			else {
+				horizontalFixed<BPP>(img->data + vi * rowStride, rows[0], t, img->width, newWidth);
+				rowId[0] = vi;
+			}
+		}
+		if (rowId[1] != vn) {
+			horizontalFixed<BPP>(img->data + vn * rowStride, rows[1], t, img->width, newWidth);
+			rowId[1] = vn;
+		}
+		verticalFixed(rows[0], rows[1], t->yWeight[y], dst + y * rowLen, rowLen);
+	}
+}
+
+// resampleSeparable
+//
+// Two pass kernel for ResampleBillinear. Source rows are first
+// interpolated horizontally into float rows using the cached column
+// table, then each destination row is a vertical blend of two such
+// rows. Both passes walk memory row by row, and a horizontally
+// resampled row is reused as long as destination rows map onto it.
+//
+// @param img - source image
+// @param dst - destination buffer of newWidth*newHeight*BPP bytes
+// @param t - tables from getResampleTable
+// @param x0, x1 - destination columns [x0, x1) to compute
+// @param y0, y1 - destination rows [y0, y1) to compute
+// @param row0, row1 - scratch rows of ((x1 - x0)*BPP + 4) floats
+template<int BPP>
+void TargaHandler::resampleSeparable(Image* img, unsigned char* dst, const ResampleTable* t,
+                                     int newWidth, int x0, int x1, int y0, int y1, float* row0, float* row1) {
+	const int rowStride = img->width * BPP;
+	const int rowLen = newWidth * BPP;
+	const int n = (x1 - x0) * BPP;
+	float* rows[2] = { row0, row1 };
+	int rowId[2] = { -1, -1 };
+
+	for (int y = y0; y < y1; y++) {
+		int vi = t->yIdx[y];
+		int vn = (vi + 1 < img->height) ? vi + 1 : vi;
+		if (rowId[0] != vi) {
+			if (rowId[1] == vi) {
+				float* tmp = rows[0]; rows[0] = rows[1]; rows[1] = tmp;
+				rowId[0] = vi;
+				rowId[1] = -1;
+			}
+			else {
+				horizontalPass<BPP>(img->data + vi * rowStride, rows[0], t, img->width, x0, x1);
+				rowId[0] = vi;
+			}
+		}
+		if (rowId[1] != vn) {
+			horizontalPass<BPP>(img->data + vn * rowStride, rows[1], t, img->width, x0, x1);
+			rowId[1] = vn;
+		}
+		verticalPass(rows[0], rows[1], t->yWeight[y], dst + y * rowLen + x0 * BPP, n);
+	}
+}
+
+// resampleBands
+//
+// Splits the destination rows into bands and runs the SIMD or 
+// SEPARABLE kernel over them, on the thread pool if one is set. 
+// Every destination row is computed independently of the band it
+// lands in, so the output is the same for any thread count. 
+// Each band takes its scratch rows from the shared ScratchArena,
+// which ResampleBillinear resets when done.
+template<int BPP>
+void TargaHandler::resampleBands(Image* img, unsigned char* dst, int newWidth, int newHeight) {
+	int bands = bandCount(newHeight);
+
+	if (m_kernel == SIMD) {
+		auto band = [&](int b) {
+			resampleSIMD<BPP>(img, dst, newWidth, newHeight,
+			                  newHeight * b / bands, newHeight * (b + 1) / bands);
+		};
+		if (bands > 1) m_pool->parallelFor(bands, band);
+		else band(0);
+		return;
+	}
+	if (m_kernel == FIXED) {
+		const FixedTable* t = getFixedTable(img->width, img->height, newWidth, newHeight);
+		auto band = [&](int b) {
+			uint16_t* row0 = m_scratch.allocate<uint16_t>(newWidth * BPP + 4);
+			uint16_t* row1 = m_scratch.allocate<uint16_t>(newWidth * BPP + 4);
+			resampleFixed<BPP>(img, dst, t, newWidth, newHeight * b / bands,
+			                   newHeight * (b + 1) / bands, row0, row1);
+		};
+		if (bands > 1) m_pool->parallelFor(bands, band);
+		else band(0);
+		return;
+	}
+
+	const ResampleTable* t = getResampleTable(img->width, img->height, newWidth, newHeight);
+	if (m_tileWidth > 0) {
+		resampleTiles<BPP>(img, dst, t, newWidth, newHeight);
+		return;
+	}
+	const int buffLen = newWidth * BPP + 4;
+
+	auto band = [&](int b) {
+		float* row0 = m_scratch.allocate<float>(buffLen);
+		float* row1 = m_scratch.allocate<float>(buffLen);
+		resampleSeparable<BPP>(img, dst, t, newWidth, 0, newWidth, newHeight * b / bands,
+		                       newHeight * (b + 1) / bands, row0, row1);
+	};
+	if (bands > 1) m_pool->parallelFor(bands, band);
+	else band(0);
+}
+
+// resampleTiles
+//
+// SEPARABLE kernel over m_tileWidth x m_tileHeight destination tiles
+// instead of full width bands. A tile reads only the source columns
+// and rows under it, so for wide images its footprint stays in cache
+// between the horizontal and the vertical pass. Tiles are the unit
+// handed to the thread pool, row-major so neighbours share source
+// rows. Each tile keeps its two float rows on the stack.
+template<int BPP>
+void TargaHandler::resampleTiles(Image* img, unsigned char* dst, const ResampleTable* t,
+                                 int newWidth, int newHeight) {
+	const int tw = m_tileWidth;
+	const int th = m_tileHeight;
+	const int tilesX = (newWidth + tw - 1) / tw;
+	const int tilesY = (newHeight + th - 1) / th;
+
+	auto tile = [&](int i) {
+		alignas(16) float row0[TILE_MAX_WIDTH * 4 + 4];
+		alignas(16) float row1[TILE_MAX_WIDTH * 4 + 4];
+		int x0 = (i % tilesX) * tw;
+		int y0 = (i / tilesX) * th;
+		int x1 = (x0 + tw < newWidth) ? x0 + tw : newWidth;
+		int y1 = (y0 + th < newHeight) ? y0 + th : newHeight;
+		resampleSeparable<BPP>(img, dst, t, newWidth, x0, x1, y0, y1, row0, row1);
+	};
+	if (m_pool != NULL && tilesX * tilesY > 1) m_pool->parallelFor(tilesX * tilesY, tile);
+	else for (int i = 0; i < tilesX * tilesY; i++) tile(i);
+}
+
+// bandCount
+//
+// Number of row bands a kernel splits newHeight destination rows
+// into, 1 without a thread pool.
+int TargaHandler::bandCount(int newHeight) {
+	int bands = 1;
+	if (m_pool != NULL) {
+		// a few bands per thread evens out uneven finishing times
+		const int minRows = 8;
+		bands = static_cast<int>(m_pool->size() + 1) * 4;
+		if (bands > newHeight / minRows) bands = newHeight / minRows;
+		if (bands < 1) bands = 1;
+	}
+	return bands;
+}
+
+// boxFactor
+//
+// N if scale is 1/N for an integer N (up to float rounding of the
+// scale itself), 0 otherwise.
+int TargaHandler::boxFactor(float scale) {
+	if (scale <= 0 || scale > 1) return 0;
+	int n = static_cast<int>(1.0f / scale + 0.5f);
+	if (n < 1 || n > BOX_MAX_AREA) return 0;
+	return (fabsf(scale * n - 1.0f) < 1e-6f) ? n : 0;
+}
+
+// sumRows
+//
+// sums[i] = sum of src[i] over 'rows' rows 'stride' bytes apart,
+// 16 components per step. rows * 255 has to fit 16 bits.
+static void sumRows(const unsigned char* src, int stride, int rows, int n, unsigned short* sums) {
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i lo = zero, hi = zero;
+		for (int r = 0; r < rows; r++) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + r * stride + i));
+			lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+			hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+		}
+		_mm_storeu_si128((__m128i*)(sums + i), lo);
+		_mm_storeu_si128((__m128i*)(sums + i + 8), hi);
+	}
+	for (; i < n; i++) {
+		unsigned short sum = 0;
+		for (int r = 0; r < rows; r++) sum += src[r * stride + i];
+		sums[i] = sum;
+	}
+}
+
+// resampleBox
+//
+// Area average for scales 1/fx, 1/fy: every destination pixel is 
+// the rounded mean of an fx*fy block of source pixels. Per row the
+// fy source rows are summed into 16 bit lanes, then fx neighbouring
+// pixels are added at every offset (8 lanes per step, the stride is
+// the pixel size). Power of two areas are rounded and shifted in 
+// the same step; other areas divide exactly by a 32 bit reciprocal.
+// Finally every fx-th pixel is kept.
+//
+// @param fx, fy - integer reduction factors, fx * fy <= BOX_MAX_AREA
+template<int BPP>
+void TargaHandler::resampleBox(Image* img, unsigned char* dst, int newWidth, int newHeight, int fx, int fy) {
+	const int area = fx * fy;
+	const int stride = img->width * BPP;
+	const int rowLen = newWidth * BPP;
+	// only the columns covered by whole blocks are read
+	const int n = newWidth * fx * BPP;
+	// the last tap loads reach (fx - 1) pixels and 7 lanes past n
+	const int sumsLen = n + (fx - 1) * BPP + 8;
+	int shift = -1;
+	for (int b = 0; b < 16; b++) if ((1 << b) == area) shift = b;
+	// floor(x / area) == (x * recip) >> 32 for every x below 2^24
+	const uint64_t recip = ((static_cast<uint64_t>(1) << 32) + area - 1) / area;
+	const int bands = bandCount(newHeight);
+
+	auto band = [&](int b) {
+		unsigned short* sums = m_scratch.allocate<unsigned short>(sumsLen);
+		unsigned short* taps = m_scratch.allocate<unsigned short>(n + 8);
+		unsigned char* avg = m_scratch.allocate<unsigned char>(n + 16);
+		memset(sums + n, 0, (sumsLen - n) * sizeof(unsigned short));
+		const __m128i half = _mm_set1_epi16(static_cast<short>(area / 2));
+		const __m128i count = _mm_cvtsi32_si128(shift);
+
+		for (int y = newHeight * b / bands; y < newHeight * (b + 1) / bands; y++) {
+			sumRows(img->data + y * fy * stride, stride, fy, n, sums);
+			unsigned char* out = dst + y * rowLen;
+
+			for (int i = 0; i < n; i += 8) {
+				__m128i acc = _mm_loadu_si128((const __m128i*)(sums + i));
+				for (int k = 1; k < fx; k++)
+					acc = _mm_add_epi16(acc, _mm_loadu_si128((const __m128i*)(sums + i + k * BPP)));
+				if (shift >= 0) {
+					acc = _mm_srl_epi16(_mm_add_epi16(acc, half), count);
+					_mm_storel_epi64((__m128i*)(avg + i), _mm_packus_epi16(acc, acc));
+				}
+				else _mm_storeu_si128((__m128i*)(taps + i), acc);
+			}
+
+			if (shift >= 0) {
+				if (fx == 1) memcpy(out, avg, rowLen);
+				else for (int x = 0; x < newWidth; x++)
+					memcpy(out + x * BPP, avg + x * fx * BPP, BPP);
+			}
+			else {
+				for (int x = 0; x < newWidth; x++)
+					for (int c = 0; c < BPP; c++) {
+						uint64_t sum = taps[x * fx * BPP + c] + area / 2;
+						out[x * BPP + c] = static_cast<unsigned char>((sum * recip) >> 32);
+					}
+			}
+		}
+	};
+	if (bands > 1) m_pool->parallelFor(bands, band);
+	else band(0);
+}
+
+// filterKernel
+//
+// Keys cubic (a = -0.5) and Lanczos-3 weight at distance x.
+static float filterKernel(FILTER filter, float x) {
+	x = fabsf(x);
+	if (filter == LANCZOS3) {
+		if (x < 1e-6f) return 1.0f;
+		if (x >= 3.0f) return 0.0f;
+		const float pi = 3.14159265358979f;
+		return 3.0f * sinf(pi * x) * sinf(pi * x / 3.0f) / (pi * pi * x * x);
+	}
+	const float a = -0.5f;
+	if (x < 1.0f) return ((a + 2.0f) * x - (a + 3.0f)) * x * x + 1.0f;
+	if (x < 2.0f) return ((a * x - 5.0f * a) * x + 8.0f * a) * x - 4.0f * a;
+	return 0.0f;
+}
+
+// getFilterTable
+//
+// Window start and normalized weights of every destination sample
+// along one axis. On downscale the kernel is stretched by 1/scale so
+// it averages all covered source samples. The tap count is rounded
+// up to one of the specialized kernels (zero weights pad it), taps 
+// that fall outside the image are folded onto the edge sample so 
+// every window lies inside [0, srcSize). Cached per geometry.
+const FilterTable* TargaHandler::getFilterTable(FILTER filter, int srcSize, int dstSize) {
+	uint64_t key = ((uint64_t)filter << 32) | ((uint64_t)(uint16_t)srcSize << 16) | (uint16_t)dstSize;
+	auto found = m_filterMap.find(key);
+	if (found != std::end(m_filterMap))
+		return found->second;
+
+	const float scale = dstSize / (float)srcSize;
+	const float stretch = (scale < 1.0f) ? 1.0f / scale : 1.0f;
+	const float support = ((filter == LANCZOS3) ? 3.0f : 2.0f) * stretch;
+	const int span = static_cast<int>(ceilf(2.0f * support));
+	static const int sizes[] = { 4, 6, 8, 12, 16, 24 };
+	int taps = span;
+	for (int s : sizes) {
+		if (s >= span) { taps = s; break; }
+	}
+	if (taps > srcSize) taps = srcSize;
+
+	FilterTable* table = new FilterTable();
+	table->taps = taps;
+	table->start.resize(dstSize);
+	table->weight.assign(static_cast<size_t>(dstSize) * taps, 0.0f);
+	for (int i = 0; i < dstSize; i++) {
+		float center = (i + 0.5f) / scale - 0.5f;
+		int left = static_cast<int>(floorf(center - support)) + 1;
+		int start = left;
+		if (start > srcSize - taps) start = srcSize - taps;
+		if (start < 0) start = 0;
+		table->start[i] = start;
+
+		float* w = &table->weight[static_cast<size_t>(i) * taps];
+		float sum = 0.0f;
+		for (int s = left; s < left + span; s++) {
+			float weight = filterKernel(filter, (s - center) / stretch);
+			int idx = (s < 0) ? 0 : (s >= srcSize) ? srcSize - 1 : s;
+			w[idx - start] += weight;
+			sum += weight;
+		}
+		if (sum != 0.0f)
+			for (int k = 0; k < taps; k++) w[k] /= sum;
+	}
+	m_filterMap[key] = table;
+	return table;
+}
+
+// sumLanes
+//
+// Lane sums of four vectors, lane i of the result is the sum of the
+// lanes of the i-th argument.
+static inline __m128 sumLanes(__m128 a, __m128 b, __m128 c, __m128 d) {
+	_MM_TRANSPOSE4_PS(a, b, c, d);
+	return _mm_add_ps(_mm_add_ps(a, b), _mm_add_ps(c, d));
+}
+
+// splitPlanes
+//
+// Widens a row of BGR(A) pixels to one float plane per channel, four
+// pixels per step. 24 bit rows are read 16 bytes at a time (the last
+// few pixels, which such a read would overrun, one by one) and sorted
+// into channels with shuffles; byte copies through memory as in
+// loadPixelPS would stall each step on store forwarding.
+template<int BPP>
+static void splitPlanes(const unsigned char* src, float* const* plane, int srcW) {
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+	if (BPP == 4) {
+		for (; x + 4 <= srcW; x += 4) {
+			__m128i px = _mm_loadu_si128((const __m128i*)(src + x * 4));
+			__m128i lo = _mm_unpacklo_epi8(px, zero);
+			__m128i hi = _mm_unpackhi_epi8(px, zero);
+			__m128 p0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+			__m128 p1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+			__m128 p2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+			__m128 p3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+			_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+			_mm_storeu_ps(plane[0] + x, p0);
+			_mm_storeu_ps(plane[1] + x, p1);
+			_mm_storeu_ps(plane[2] + x, p2);
+			_mm_storeu_ps(plane[3] + x, p3);
+		}
+	}
+	else {
+		for (; x * 3 + 16 <= srcW * 3; x += 4) {
+			// f0 = b0 g0 r0 b1, f1 = g1 r1 b2 g2, f2 = r2 b3 g3 r3
+			__m128i px = _mm_loadu_si128((const __m128i*)(src + x * 3));
+			__m128i lo = _mm_unpacklo_epi8(px, zero);
+			__m128i hi = _mm_unpackhi_epi8(px, zero);
+			__m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+			__m128 f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+			__m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+			__m128 b = _mm_shuffle_ps(f0, _mm_shuffle_ps(f1, f2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+			__m128 g = _mm_shuffle_ps(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(0, 0, 1, 1)),
+			                          _mm_shuffle_ps(f1, f2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 r = _mm_shuffle_ps(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(1, 1, 2, 2)), f2, _MM_SHUFFLE(3, 0, 2, 0));
+			_mm_storeu_ps(plane[0] + x, b);
+			_mm_storeu_ps(plane[1] + x, g);
+			_mm_storeu_ps(plane[2] + x, r);
+		}
+	}
+	for (; x < srcW; x++)
+		for (int c = 0; c < BPP; c++) plane[c][x] = src[x * BPP + c];
+}
+
+// horizontalFilter
+//
+// One source row through the horizontal filter. When TAPS is a
+// multiple of four the row is split into one float plane per channel
+// and each destination pixel takes TAPS / 4 four-wide multiply-adds
+// per channel along the planes, with the weights loaded as they are
+// stored. Otherwise (TAPS == 0 reads the count from the table) the
+// row is widened to one float quad per pixel and each tap is one
+// multiply-add of a whole pixel.
+template<int BPP, int TAPS>
+static void horizontalFilter(const unsigned char* src, float* pix, float* out,
+                             const FilterTable* t, int srcW, int dstW) {
+	const float* w = t->weight.data();
+	if (TAPS % 4 == 0 && TAPS > 0) {
+		float* plane[4] = { pix, pix + srcW, pix + 2 * srcW, pix + 3 * srcW };
+		splitPlanes<BPP>(src, plane, srcW);
+
+		for (int x = 0; x < dstW; x++, w += TAPS) {
+			const int s = t->start[x];
+			__m128 wk = _mm_loadu_ps(w);
+			__m128 acc0 = _mm_mul_ps(_mm_loadu_ps(plane[0] + s), wk);
+			__m128 acc1 = _mm_mul_ps(_mm_loadu_ps(plane[1] + s), wk);
+			__m128 acc2 = _mm_mul_ps(_mm_loadu_ps(plane[2] + s), wk);
+			__m128 acc3 = (BPP == 4) ? _mm_mul_ps(_mm_loadu_ps(plane[3] + s), wk) : _mm_setzero_ps();
+			for (int k = 4; k < TAPS; k += 4) {
+				wk = _mm_loadu_ps(w + k);
+				acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(plane[0] + s + k), wk));
+				acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(plane[1] + s + k), wk));
+				acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(plane[2] + s + k), wk));
+				if (BPP == 4) acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(plane[3] + s + k), wk));
+			}
+			_mm_storeu_ps(out + x * BPP, sumLanes(acc0, acc1, acc2, acc3));
+		}
+		return;
+	}
+
+	for (int x = 0; x < srcW; x++)
+		_mm_store_ps(pix + x * 4, loadPixelPS<BPP>(src + x * BPP));
+
+	const int taps = TAPS ? TAPS : t->taps;
+	for (int x = 0; x < dstW; x++, w += taps) {
+		const float* p = pix + t->start[x] * 4;
+		__m128 acc = _mm_mul_ps(_mm_load_ps(p), _mm_set1_ps(w[0]));
+		for (int k = 1; k < taps; k++)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(p + k * 4), _mm_set1_ps(w[k])));
+		_mm_storeu_ps(out + x * BPP, acc);
+	}
+}
+
+// verticalFilter
+//
+// Blends TAPS horizontally filtered rows into one destination row,
+// 8 components per step, rounded and saturated to 0..255.
+template<int TAPS>
+static void verticalFilter(float* const* rows, const float* w, int taps, unsigned char* out, int n) {
+	if (TAPS) taps = TAPS;
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_setzero_ps();
+		__m128 b = _mm_setzero_ps();
+		for (int k = 0; k < taps; k++) {
+			__m128 wk = _mm_set1_ps(w[k]);
+			a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(rows[k] + i), wk));
+			b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(rows[k] + i + 4), wk));
+		}
+		__m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(packed, packed));
+	}
+	for (; i < n; i++) {
+		float sum = 0.0f;
+		for (int k = 0; k < taps; k++) sum += rows[k][i] * w[k];
+		int v = static_cast<int>(floorf(sum + 0.5f));
+		out[i] = static_cast<unsigned char>((v < 0) ? 0 : (v > 255) ? 255 : v);
+	}
+}
+
+typedef void (*HorizontalFilterFn)(const unsigned char*, float*, float*, const FilterTable*, int, int);
+typedef void (*VerticalFilterFn)(float* const*, const float*, int, unsigned char*, int);
+
+template<int BPP>
+static HorizontalFilterFn pickHorizontal(int taps) {
+	switch (taps) {
+	case 4:  return horizontalFilter<BPP, 4>;
+	case 6:  return horizontalFilter<BPP, 6>;
+	case 8:  return horizontalFilter<BPP, 8>;
+	case 12: return horizontalFilter<BPP, 12>;
+	case 16: return horizontalFilter<BPP, 16>;
+	case 24: return horizontalFilter<BPP, 24>;
+	default: return horizontalFilter<BPP, 0>;
+	}
+}
+
+static VerticalFilterFn pickVertical(int taps) {
+	switch (taps) {
+	case 4:  return verticalFilter<4>;
+	case 6:  return verticalFilter<6>;
+	case 8:  return verticalFilter<8>;
+	case 12: return verticalFilter<12>;
+	case 16: return verticalFilter<16>;
+	case 24: return verticalFilter<24>;
+	default: return verticalFilter<0>;
+	}
+}
+
+// resampleFiltered
+//
+// Separable BICUBIC / LANCZOS3 resampling on row bands. Each band 
+// keeps the last yTaps horizontally filtered source rows in a ring
+// (row r in slot r % yTaps); since window starts only grow with y,
+// every source row of a band is filtered horizontally once.
+template<int BPP>
+void TargaHandler::resampleFiltered(Image* img, unsigned char* dst, int newWidth, int newHeight) {
+	const FilterTable* tx = getFilterTable(m_filter, img->width, newWidth);
+	const FilterTable* ty = getFilterTable(m_filter, img->height, newHeight);
+	HorizontalFilterFn horizontal = pickHorizontal<BPP>(tx->taps);
+	VerticalFilterFn vertical = pickVertical(ty->taps);
+	const int yTaps = ty->taps;
+	const int rowStride = img->width * BPP;
+	const int rowLen = newWidth * BPP;
+	const int bands = bandCount(newHeight);
+
+	auto band = [&](int b) {
+		float* pix = m_scratch.allocate<float>(img->width * 4);
+		float** ring = m_scratch.allocate<float*>(yTaps * 2);
+		float** rows = ring + yTaps;
+		int* rowId = m_scratch.allocate<int>(yTaps);
+		for (int k = 0; k < yTaps; k++) {
+			ring[k] = m_scratch.allocate<float>(rowLen + 4);
+			rowId[k] = -1;
+		}
+		for (int y = newHeight * b / bands; y < newHeight * (b + 1) / bands; y++) {
+			int start = ty->start[y];
+			for (int k = 0; k < yTaps; k++) {
+				int r = start + k;
+				int slot = r % yTaps;
+				if (rowId[slot] != r) {
+					horizontal(img->data + r * rowStride, pix, ring[slot], tx, img->width, newWidth);
+					rowId[slot] = r;
+				}
+				rows[k] = ring[slot];
+			}
+			vertical(rows, &ty->weight[static_cast<size_t>(y) * yTaps], yTaps, dst + y * rowLen, rowLen);
+		}
+	};
+	if (bands > 1) m_pool->parallelFor(bands, band);
+	else band(0);
+}
+
+// resizeStreaming
+//
+// Bilinear resize from file to file that never holds a whole image.
+// Source scanlines are decoded on demand, each is interpolated 
+// horizontally right away, and only the two rows the current 
+// destination row blends between are kept. Each destination row is 
+// written (and RLE encoded if requested) as soon as it is done, so
+// memory use grows with the width only. Output pixels equal loadTGA
+// + ResampleBillinear + saveTGA. Rows can only be read in file order,
+// so bottom-up inputs give bottom-up outputs: the destination rows 
+// are produced last first, each sampled where the in-memory path 
+// samples it.
+//
+// @param input - TGA to read, RLE or uncompressed
+// @param output - TGA to write
+// @param comp - compression of the output
+//
+// @return false if the input cannot be read or the output written
+bool TargaHandler::resizeStreaming(const char* input, const char* output, float scalex, float scaley, COMPRESSION comp) {
+	METRICS_SCOPE(STAGE_STREAM);
+	SourceStream src;
+	if (!openStream(input, &src))
+		return false;
+
+	int newWidth = static_cast<int>(src.width * scalex);
+	int newHeight = static_cast<int>(src.height * scaley);
+	if (newWidth <= 0 || newHeight <= 0) {
+		printf("Scaling results in an empty image\n");
+		closeStream(&src);
+		return false;
+	}
+
+	FILE* filePtr;
+	fopen_s(&filePtr, output, "wb");
+	if (filePtr == NULL) {
+		printf("Cannot open file specified\n");
+		closeStream(&src);
+		return false;
+	}
+	Header header;
+	initHeader(&header, newWidth, newHeight, src.bpp, comp);
+	if (src.bottomUp) header.imagedescriptor = 0;
+	writeHeader(&header, filePtr);
+
+	const ResampleTable* t = getResampleTable(src.width, src.height, newWidth, newHeight);
+	bool success = (src.bpp == 4) ? streamRows<4>(&src, filePtr, t, newWidth, newHeight, comp)
+	                              : streamRows<3>(&src, filePtr, t, newWidth, newHeight, comp);
+	fclose(filePtr);
+	closeStream(&src);
+	m_scratch.reset();
+	return success;
+}
+
+// streamRows
+//
+// Row loop of resizeStreaming. rows[] hold the horizontally resampled
+// source rows rowId[] (file order), the destination row y blends 
+// yIdx[y] and the row below it. Bottom-up sources are walked from the
+// last destination row up, so the rows needed still come in file 
+// order. Source rows are only read forward; rows no 
+// destination row needs, most of them when downscaling, are skipped
+// without being stored, see skipScanlines.
+template<int BPP>
+bool TargaHandler::streamRows(SourceStream* s, FILE* out, const ResampleTable* t,
+                              int newWidth, int newHeight, COMPRESSION comp) {
+	const int srcBytes = s->width * BPP;
+	const int rowLen = newWidth * BPP;
+	const int floatBytes = (rowLen + 4) * sizeof(float);
+	const int rleBytes = rowLen + (newWidth + 127) / 128;
+
+	unsigned char* srcRow = m_scratch.allocate<unsigned char>(srcBytes);
+	unsigned char* dstRow = m_scratch.allocate<unsigned char>(rowLen);
+	unsigned char* rleRow = (comp == RLE) ? m_scratch.allocate<unsigned char>(rleBytes) : NULL;
+	float* rows[2];
+	rows[0] = m_scratch.allocate<float>(rowLen + 4);
+	rows[1] = m_scratch.allocate<float>(rowLen + 4);
+	int rowId[2] = { -1, -1 };
+	bool success = true;
+
+	for (int j = 0; j < newHeight && success; j++) {
+		// j counts rows in file order, y is the top-down row it holds.
+		// first / second are the file rows of its two taps, both only
+		// grow with j.
+		int y = s->bottomUp ? newHeight - 1 - j : j;
+		int vi = t->yIdx[y];
+		int vn = (vi + 1 < s->height) ? vi + 1 : vi;
+		int first = s->bottomUp ? s->height - 1 - vn : vi;
+		int second = s->bottomUp ? s->height - 1 - vi : vn;
+		if (rowId[1] == first && rowId[0] != first) {
+			float* tmp = rows[0]; rows[0] = rows[1]; rows[1] = tmp;
+			rowId[0] = first;
+			rowId[1] = -1;
+		}
+		for (int slot = 0; slot < 2 && success; slot++) {
+			int want = (slot == 0) ? first : second;
+			if (rowId[slot] == want) continue;
+			if (slot == 1 && rowId[0] == want) {
+				// one source row high image, both taps on the same row
+				memcpy(rows[1], rows[0], floatBytes);
+				rowId[1] = want;
+				continue;
+			}
+			if (s->nextRow <= want)
+				success = skipScanlines<BPP>(s, want - s->nextRow) && readScanline<BPP>(s, srcRow);
+			if (!success) break;
+			horizontalPass<BPP>(srcRow, rows[slot], t, s->width, 0, newWidth);
+			rowId[slot] = want;
+		}
+		if (!success) break;
+
+		if (s->bottomUp) verticalPass(rows[1], rows[0], t->yWeight[y], dstRow, rowLen);
+		else verticalPass(rows[0], rows[1], t->yWeight[y], dstRow, rowLen);
+		if (comp == RLE) {
+			size_t size = encodeRLE<BPP>(dstRow, newWidth, rleRow);
+			fwrite(rleRow, sizeof(unsigned char), size, out);
+			METRICS_ADD(BYTES_WRITTEN, size);
+		}
+		else {
+			fwrite(dstRow, sizeof(unsigned char), rowLen, out);
+			METRICS_ADD(BYTES_WRITTEN, rowLen);
+		}
+	}
+	METRICS_ADD(PIXELS_RESAMPLED, newWidth * newHeight);
+
+	return success;
+}
+
+// openStream
+//
+// Opens a TGA for scanline reading and positions the stream at the
+// first pixel. RLE input gets a small read buffer from the scratch
+// arena, released with it by the caller.
+//
+// @return false if the file cannot be opened or is not supported
+bool TargaHandler::openStream(const char* filename, SourceStream* s) {
+	*s = SourceStream{};
+	fopen_s(&s->file, filename, "rb");
+	if (s->file == NULL) {
+		printf("Cannot open file specified\n");
+		return false;
+	}
+	readHeader(s->file);
+	if ((m_header.width <= 0) || (m_header.height <= 0)
+		|| ((m_header.bitCount != 24) && (m_header.bitCount != 32))
+		|| ((m_header.datatypecode != 2) && (m_header.datatypecode != 10))) {
+		printf("Invalid data format\n");
+		fclose(s->file);
+		return false;
+	}
+	s->width = m_header.width;
+	s->height = m_header.height;
+	s->bpp = m_header.bitCount / 8;
+	s->rle = (m_header.datatypecode == 10);
+	s->bottomUp = (m_header.imagedescriptor & 0x20) == 0;
+	// skip the image ID field following the header
+	fseek(s->file, (unsigned char)m_header.idlength, SEEK_CUR);
+
+	if (s->rle) {
+		// must hold at least one full raw packet
+		s->buffSize = 64 * 1024;
+		s->buff = m_scratch.allocate<unsigned char>(s->buffSize);
 	}
 	return true;
 }
 
-// saveUncompressed
+// fillStream
+//
+// Makes sure at least 'need' unread bytes are buffered, moving the
+// unread tail to the front and reading more from the file.
+//
+// @return false if the file ends first
+bool TargaHandler::fillStream(SourceStream* s, size_t need) {
+	size_t left = s->buffLen - s->buffPos;
+	if (left >= need) return true;
+	memmove(s->buff, s->buff + s->buffPos, left);
+	size_t readBytes = fread(s->buff + left, 1, s->buffSize - left, s->file);
+	METRICS_ADD(BYTES_READ, readBytes);
+	s->buffLen = left + readBytes;
+	s->buffPos = 0;
+	return s->buffLen >= need;
+}
+
+// readScanline
 //
-// Saves an uncompressed tga image to disk 
+// Decodes the next scanline of the stream into row (width*bpp bytes).
+// Failures are reported with the same messages as loadTGA.
+//
+// @param row - NULL to step over an RLE scanline, its packets are
+//              parsed but not expanded
+template<int BPP>
+bool TargaHandler::readScanline(SourceStream* s, unsigned char* row) {
+	const unsigned int width = s->width;
+	s->nextRow++;
+
+	if (!s->rle) {
+		if (fread(row, 1, width * BPP, s->file) != width * BPP) {
+			printf("Error reading uncompressed data\n");
+			return false;
+		}
+		METRICS_ADD(BYTES_READ, width * BPP);
+		return true;
+	}
+
+	unsigned int px = 0;
+	while (px < width) {
+		if (s->packetLeft == 0) {
+			if (!fillStream(s, 1)) {
+				printf("Could not read header\n");
+				return false;
+			}
+			unsigned char headerInfo = s->buff[s->buffPos++];
+			s->packetLeft = (headerInfo & 127) + 1;
+			s->packetRun = (headerInfo >= 128);
+			if (s->packetRun) {
+				if (!fillStream(s, BPP)) {
+					printf("Could not read image data\n");
+					return false;
+				}
+				memcpy(s->runPixel, s->buff + s->buffPos, BPP);
+				s->buffPos += BPP;
+			}
+		}
+		unsigned int count = (s->packetLeft < width - px) ? s->packetLeft : width - px;
+		if (s->packetRun) {
+			if (row != NULL) fillPixels<BPP>(row + px * BPP, s->runPixel, count);
+		}
+		else {
+			if (!fillStream(s, count * BPP)) {
+				printf("Could not read image data\n");
+				return false;
+			}
+			if (row != NULL) memcpy(row + px * BPP, s->buff + s->buffPos, count * BPP);
+			s->buffPos += count * BPP;
+		}
+		px += count;
+		s->packetLeft -= count;
+	}
+	// a packet may continue on the next row, but not past the last one
+	if (s->nextRow == s->height && s->packetLeft > 0) {
+		printf("Out of bounds when readign pixel data!\n");
+		return false;
+	}
+	if (row != NULL) METRICS_ADD(PIXELS_DECODED, width);
+	return true;
+}
+
+// skipScanlines
+//
+// Moves the stream past the next 'count' scanlines without storing
+// them. Uncompressed rows are seeked over and never read, RLE rows
+// still have to be parsed, packet lengths are only known that way,
+// but their pixels are not expanded. A file ending among the skipped
+// rows is reported by the next readScanline.
+template<int BPP>
+bool TargaHandler::skipScanlines(SourceStream* s, int count) {
+	if (count <= 0) return true;
+	if (!s->rle) {
+		s->nextRow += count;
+		return fseek(s->file, static_cast<long>(count) * s->width * BPP, SEEK_CUR) == 0;
+	}
+	for (int i = 0; i < count; i++) {
+		if (!readScanline<BPP>(s, NULL)) return false;
+	}
+	return true;
+}
+
+// closeStream
+void TargaHandler::closeStream(SourceStream* s) {
+	if (s->file != NULL) fclose(s->file);
+	s->file = NULL;
+	s->buff = NULL;
+}
+
+// saveTGA
+//
+// Determines method of compression for tga image.
+// Supports uncompressed and RLE writing. The pixel data is 
+// released afterwards, also when writing fails.
 //
-// @param h - header file based on http://www.paulbourke.net/dataformats/tga/
 // @param filename - output file name
 // @param img - image pixel container 
-bool TargaHandler::saveUncompressed(Header* header, const char* filename, Image* img) {
+// @param comp - enum determining which compression to use
+//
+// @return returns the outcome of func. writeTGA
+bool TargaHandler::saveTGA(const char *filename, Image* img, COMPRESSION comp) {
+	if (comp != UNCOMPRESSED && comp != RLE) {
+		printf("Unsupported compression format\n");
+		return false;
+	}
+	bool written = writeTGA(filename, img, comp);
+	bool freed = releaseData(img);
+	return written && freed;
+}
+
+// writeTGA
+//
+// saveTGA without releasing the image, so it can still be read 
+// (resampled, written elsewhere) afterwards. Only reads img, several
+// images may be written from different threads at once.
+bool TargaHandler::writeTGA(const char *filename, const Image* img, COMPRESSION comp) {
+	EncodedImage e;
+	if (!encodeTGA(img, comp, &e))
+		return false;
+
 	FILE *filePtr;
 	// Open file
 	fopen_s(&filePtr, filename, "wb");
 	if (filePtr == NULL) {
 		printf("Cannot open file specified\n");
+		releaseEncoded(&e);
+		return false;
 	}
-	writeHeader(header, filePtr);
-	// write data to file
-	fwrite(img->data, sizeof(unsigned char), img->imageSize, filePtr);
-	fclose(filePtr);
-
-	bool freed = freeMemory(&img->data[0], img->imageSize);
-	if (!freed) return false;
-
+	// write header and data to file, one vectored write for all parts
+	std::vector<IoVec> iov(1 + e.parts.size());
+	iov[0].iov_base = e.header;
+	iov[0].iov_len = 18;
+	std::copy(e.parts.begin(), e.parts.end(), iov.begin() + 1);
+	bool written;
+	{
+		METRICS_SCOPE(STAGE_WRITE);
+		written = writeVectored(filePtr, iov.data(), static_cast<unsigned int>(iov.size()));
+		if (fclose(filePtr) != 0) written = false;
+	}
+	releaseEncoded(&e);
+	if (!written) {
+		printf("Cannot write to file specified\n");
+		return false;
+	}
+	METRICS_ADD(BYTES_WRITTEN, 18 + e.length);
 	return true;
 }
-// -------------------------------------------
-//	Below, some some convenience functions put away 
-//	to make the code above a bit more readable/compact
-// -------------------------------------------
 
-// closeAndFree
-// 
-// Resp. for freeing buffer and any image data used during loading of tga image
-// as well as closing and disassociating the file associated with the stream.
-void TargaHandler::closeAndFree(Image* img, FILE * filePtr, unsigned char* pbuff) {
-	if (filePtr != NULL)   fclose(filePtr);
-	if (pbuff != NULL)     free(pbuff);
-	if (img->data != NULL) free(img->data);
-}
-
-// readPixel
-//
-// Reads a single pixel in the file stream during loading of tga image
-bool TargaHandler::readPixel(unsigned char* p, Image* img, FILE* filePtr) {
-	size_t readBytes = fread(p, 1, img->bpp, filePtr);
-	if (readBytes != img->bpp) {
-		printf("Could not read image data\n");
-		closeAndFree(img, filePtr, p);
+// encodeTGA
+//
+// Everything of writeTGA but the file I/O, for callers writing the
+// header and data themselves (e.g. with one vectored write). Must be
+// followed by releaseEncoded once the bytes are written.
+//
+// @return false for an unsupported compression
+bool TargaHandler::encodeTGA(const Image* img, COMPRESSION comp, EncodedImage* out) {
+	if (comp != UNCOMPRESSED && comp != RLE) {
+		printf("Unsupported compression format\n");
 		return false;
 	}
+	// create generic header
+	Header gHeader;
+	initHeader(&gHeader, img->width, img->height, img->padded ? 3 : img->bpp, comp);
+	formatHeader(&gHeader, out->header);
+	out->owned = NULL;
+	out->ownedSize = 0;
+	if (comp == UNCOMPRESSED) encodeUncompressed(img, out);
+	else encodeCompressed(img, out);
 	return true;
 }
 
-// storePixel
+// releaseEncoded
+//
+// Frees the buffer encodeTGA allocated, if any.
+void TargaHandler::releaseEncoded(EncodedImage* e) {
+	if (e->owned != NULL) freeMemory(e->owned, e->ownedSize);
+	e->owned = NULL;
+	e->parts.clear();
+}
+
+// initHeader
+//
+// Generic header for output files, always top-left origin.
+void TargaHandler::initHeader(Header* h, int width, int height, int bpp, COMPRESSION comp) {
+	*h = Header{};
+	h->width = width;
+	h->height = height;
+	h->bitCount = bpp * 8;
+	h->imagedescriptor = 32; // tb read from upper-left corner
+	h->datatypecode = (comp == RLE) ? 10 : 2; // compressed / uncompressed code
+}
+
+// encodeUncompressed
+//
+// Uncompressed pixel data is the image itself, only padded images
+// are packed back to 24 bit into an owned buffer.
+//
+// @param img - image pixel container 
+// @param out - receives the data to write after the header
+void TargaHandler::encodeUncompressed(const Image* img, EncodedImage* out) {
+	IoVec part;
+	part.iov_base = img->data;
+	part.iov_len = img->imageSize;
+	if (img->padded) {
+		// back to 24 bit, the only conversion out of the padded layout
+		out->ownedSize = static_cast<size_t>(img->width) * img->height * 3;
+		out->owned = newMemory<unsigned char>(out->ownedSize, m_runsExpected);
+		packPixels(img->data, out->owned, static_cast<size_t>(img->width) * img->height);
+		part.iov_base = out->owned;
+		part.iov_len = out->ownedSize;
+	}
+	out->parts.assign(1, part);
+	out->length = part.iov_len;
+}
+
+// encodeCompressed
+//
+// RLE encodes an image scanline by scanline, so packets never cross
+// a row. With a thread pool the rows are split into chunks encoded
+// in parallel, each into its own slice of one owned buffer sized for
+// the worst case; the slices become the parts, in row order, and
+// together are the same bytes a single thread would produce.
+//
+// @param img - image pixel container 
+// @param out - receives the packets to write after the header
+void TargaHandler::encodeCompressed(const Image* img, EncodedImage* out) {
+	// padded images are packed back to 24 bit a row at a time
+	const int bpp = img->padded ? 3 : img->bpp;
+	const size_t rowBytes = static_cast<size_t>(img->width) * img->bpp;
+	// worst case is one raw packet header per 128 pixels of each row
+	const size_t rowMax = static_cast<size_t>(img->width) * bpp + (img->width + 127) / 128;
+	const size_t maxSize = img->height * rowMax;
+	unsigned char* encoded = newMemory<unsigned char>(maxSize, m_runsExpected);
+
+	// chunks of whole rows, at least RLE_MIN_CHUNK pixels each
+	int chunks = 1;
+	if (m_pool != NULL && img->width > 0) {
+		const int minRows = static_cast<int>((RLE_MIN_CHUNK + img->width - 1) / img->width);
+		chunks = static_cast<int>((m_pool->size() + 1) * 4);
+		if (chunks > img->height / minRows) chunks = img->height / minRows;
+		if (chunks < 1) chunks = 1;
+	}
+	std::vector<IoVec> parts(chunks);
+	auto encodeChunk = [&](int c) {
+		const int y0 = static_cast<int>(static_cast<int64_t>(img->height) * c / chunks);
+		const int y1 = static_cast<int>(static_cast<int64_t>(img->height) * (c + 1) / chunks);
+		unsigned char* dest = encoded + y0 * rowMax;
+		unsigned char* packed = img->padded ? newMemory<unsigned char>(img->width * 3, m_runsExpected) : NULL;
+		size_t size = 0;
+		for (int y = y0; y < y1; y++) {
+			const unsigned char* row = img->data + y * rowBytes;
+			if (packed != NULL) {
+				packPixels(row, packed, img->width);
+				row = packed;
+			}
+			size += (bpp == 4) ? encodeRLE<4>(row, img->width, dest + size)
+			                   : encodeRLE<3>(row, img->width, dest + size);
+		}
+		if (packed != NULL) freeMemory(packed, img->width * 3);
+		parts[c].iov_base = dest;
+		parts[c].iov_len = size;
+	};
+	{
+		METRICS_SCOPE(STAGE_ENCODE);
+		if (chunks > 1) m_pool->parallelFor(chunks, encodeChunk);
+		else encodeChunk(0);
+	}
+	METRICS_ADD(PIXELS_ENCODED, img->width * img->height);
+
+	out->owned = encoded;
+	out->ownedSize = maxSize;
+	out->parts.swap(parts);
+	out->length = 0;
+	for (auto const& p : out->parts) out->length += p.iov_len;
+}
+
+// firstZeroBit
+//
+// Index of the lowest clear bit in a 16 bit compare mask.
+static inline int firstZeroBit(int mask) {
+	unsigned int inverted = ~static_cast<unsigned int>(mask) & 0xFFFF;
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, inverted);
+	return static_cast<int>(idx);
+#else
+	return __builtin_ctz(inverted);
+#endif
+}
+
+// countRun
 //
-// Reads pixel from buffer and stores pixels component wise  
-// into its index in an Image struct. 
-void TargaHandler::storePixel(Image* img, unsigned char* pBuff, unsigned int buffIdx) {
-	img->data[buffIdx + 0] = pBuff[0];
-	img->data[buffIdx + 1] = pBuff[1];
-	img->data[buffIdx + 2] = pBuff[2];
-	if (img->bpp == 4) img->data[buffIdx + 3] = pBuff[3];		// if alpha, 32 bpp 
+// Number of pixels starting at p that are equal to p itself, at 
+// most maxPixels. A run of n pixels means the bytes [bpp, n*bpp) 
+// equal the bytes bpp positions earlier, so pixels are compared 
+// as a byte stream against itself shifted by one pixel, sixteen
+// bytes per compare.
+template<int BPP>
+static unsigned int countRun(const unsigned char* p, unsigned int maxPixels) {
+	const size_t len = static_cast<size_t>(maxPixels - 1) * BPP;
+	size_t j = 0;
+	for (; j + 16 <= len; j += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p + j));
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + j + BPP));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+		if (mask != 0xFFFF)
+			return 1 + static_cast<unsigned int>((j + firstZeroBit(mask)) / BPP);
+	}
+	for (; j < len; j++) {
+		if (p[j] != p[j + BPP]) break;
+	}
+	return 1 + static_cast<unsigned int>(j / BPP);
+}
+
+// countRaw
+//
+// Number of pixels starting at p before the first pixel that equals
+// its right neighbour, i.e. before the next run begins, at most 
+// maxPixels. 32 bit pixels are compared four at a time, 24 bit 
+// pixels five at a time from a byte compare mask.
+template<int BPP>
+static unsigned int countRaw(const unsigned char* p, unsigned int maxPixels) {
+	const size_t limit = static_cast<size_t>(maxPixels) * BPP;
+	unsigned int k = 0;
+	if (BPP == 4) {
+		for (; k * 4 + 20 <= limit; k += 4) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(p + k * 4));
+			__m128i b = _mm_loadu_si128((const __m128i*)(p + k * 4 + 4));
+			int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+			if (mask != 0) {
+				for (int i = 0; i < 4; i++)
+					if (mask & (1 << i)) return k + i;
+			}
+		}
+	}
+	else {
+		for (; k * 3 + 19 <= limit; k += 5) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(p + k * 3));
+			__m128i b = _mm_loadu_si128((const __m128i*)(p + k * 3 + 3));
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+			// a pixel matches when all three of its byte lanes do
+			mask &= (mask >> 1) & (mask >> 2);
+			if (mask & 0x1249) {
+				for (int i = 0; i < 5; i++)
+					if (mask & (1 << (i * 3))) return k + i;
+			}
+		}
+	}
+	for (; k + 1 < maxPixels; k++) {
+		if (memcmp(p + k * BPP, p + (k + 1) * BPP, BPP) == 0) return k;
+	}
+	return maxPixels;
+}
+
+// encodeRLE
+//
+// Encodes 'count' pixels into TGA RLE packets of at most 128 pixels.
+// Runs of two or more equal pixels become run packets, everything in
+// between becomes raw packets.
+//
+// @param src - pixels to encode
+// @param dst - output, needs count*bpp + (count+127)/128 bytes
+//
+// @return number of bytes written to dst
+template<int BPP>
+size_t TargaHandler::encodeRLE(const unsigned char* src, unsigned int count, unsigned char* dst) {
+	size_t out = 0;
+	unsigned int i = 0;
+	while (i < count) {
+		const unsigned char* p = src + static_cast<size_t>(i) * BPP;
+		unsigned int maxPixels = (count - i < 128) ? count - i : 128;
+		unsigned int run = countRun<BPP>(p, maxPixels);
+		if (run >= 2) {
+			dst[out++] = sc_uchar(127 + run);
+			memcpy(dst + out, p, BPP);
+			out += BPP;
+			i += run;
+		}
+		else {
+			unsigned int raw = countRaw<BPP>(p, maxPixels);
+			dst[out++] = sc_uchar(raw - 1);
+			memcpy(dst + out, p, static_cast<size_t>(raw) * BPP);
+			out += static_cast<size_t>(raw) * BPP;
+			i += raw;
+		}
+	}
+	return out;
+}
+// -------------------------------------------
+//	Below, some some convenience functions put away 
+//	to make the code above a bit more readable/compact
+// -------------------------------------------
+
+// releaseData
+//
+// Hands the pixel data of an image back to where it came from,
+// unmapping the file for mapped images and returning the buffer to
+// its MemoryManager otherwise.
+bool TargaHandler::releaseData(Image* img) {
+	if (img->mapBase != NULL) {
+		unmapFile(img->mapBase, img->mapLength);
+		img->mapBase = NULL;
+		img->mapLength = 0;
+		img->data = NULL;
+		return true;
+	}
+	return freeMemory(&img->data[0], img->imageSize);
 }
 
 // formatHeader
 //
-// Writes header for uncompressed file. Moved here  
-// to make func. saveUncompressed easier to read. 
-void TargaHandler::writeHeader(Header *h, FILE* filePtr) {
-	unsigned char cHeader[18] = { 0 };
+// The 18 bytes of a header as they are written to disk.
+void TargaHandler::formatHeader(const Header *h, unsigned char* cHeader) {
+	memset(cHeader, 0, 18);
 	cHeader[0] = sc_uchar(h->idlength);
 	cHeader[1] = sc_uchar(h->colourmaptype);
 	cHeader[2] = sc_uchar(h->datatypecode);
@@ -387,23 +2402,46 @@ void TargaHandler::writeHeader(Header *h, FILE* filePtr) {
 	cHeader[15] = sc_uchar(h->height / 256);
 	cHeader[16] = sc_uchar(h->bitCount);
 	cHeader[17] = sc_uchar(h->imagedescriptor);
+}
+
+// writeHeader
+//
+// Writes a header ahead of data written in pieces (resizeStreaming).
+void TargaHandler::writeHeader(Header *h, FILE* filePtr) {
+	unsigned char cHeader[18];
+	formatHeader(h, cHeader);
 	fwrite(cHeader, sizeof(unsigned char), 18, filePtr);
+	METRICS_ADD(BYTES_WRITTEN, 18);
 }
+
+// parseHeader
+//
+// Fills m_header from the 18 header bytes of a file, multi byte
+// fields are little endian.
+void TargaHandler::parseHeader(const unsigned char* b) {
+	m_header.idlength = b[0];
+	m_header.colourmaptype = b[1];
+	m_header.datatypecode = b[2];
+	m_header.colourmaporigin = static_cast<short>(b[3] | (b[4] << 8));
+	m_header.colourmaplength = static_cast<short>(b[5] | (b[6] << 8));
+	m_header.colourmapdepth = b[7];
+	m_header.x_origin = static_cast<short>(b[8] | (b[9] << 8));
+	m_header.y_origin = static_cast<short>(b[10] | (b[11] << 8));
+	m_header.width = static_cast<short>(b[12] | (b[13] << 8));
+	m_header.height = static_cast<short>(b[14] | (b[15] << 8));
+	m_header.bitCount = b[16];
+	m_header.imagedescriptor = b[17];
+}
+
 // readHeader
 //
 // Reads header for input TGA files. Moved here  
 // to make func. loadTGA easier to read. 
 void TargaHandler::readHeader(FILE* filePtr) {
-	fread(&m_header.idlength, sizeof(unsigned char), 1, filePtr);
-	fread(&m_header.colourmaptype, sizeof(unsigned char), 1, filePtr);
-	fread(&m_header.datatypecode, sizeof(unsigned char), 1, filePtr);
-	fread(&m_header.colourmaporigin, sizeof(short int), 1, filePtr);
-	fread(&m_header.colourmaplength, sizeof(short int), 1, filePtr);
-	fread(&m_header.colourmapdepth, sizeof(unsigned char), 1, filePtr);
-	fread(&m_header.x_origin, sizeof(short int), 1, filePtr);
-	fread(&m_header.y_origin, sizeof(short int), 1, filePtr);
-	fread(&m_header.width, sizeof(short int), 1, filePtr);
-	fread(&m_header.height, sizeof(short int), 1, filePtr);
-	fread(&m_header.bitCount, sizeof(unsigned char), 1, filePtr);
-	fread(&m_header.imagedescriptor, sizeof(unsigned char), 1, filePtr);
+	METRICS_SCOPE(STAGE_HEADER);
+	// a short file leaves the rest zero, an invalid (empty) image
+	unsigned char cHeader[18] = { 0 };
+	fread(cHeader, sizeof(unsigned char), 18, filePtr);
+	parseHeader(cHeader);
+	METRICS_ADD(BYTES_READ, 18);
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "ThreadPool.h"
+
+// Constructor
+//
+// Starts the workers right away, they sleep until tasks arrive.
+//
+// @param threads - number of worker threads, at least one
+ThreadPool::ThreadPool(unsigned int threads) {
+	if (threads == 0) threads = 1;
+	m_pending = 0;
+	m_next = 0;
+	m_stop = false;
+	for (unsigned int i = 0; i < threads; i++)
+		m_workers.push_back(new Worker());
+	for (unsigned int i = 0; i < threads; i++)
+		m_threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+// Destructor
+//
+// Lets the workers drain what is queued, then joins them.
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(m_sleepLock);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (auto& t : m_threads) t.join();
+	for (auto w : m_workers) delete w;
+}
+
+// submit
+//
+// Queues a task on the next worker in round robin order. 
+void ThreadPool::submit(std::function<void()> task) {
+	unsigned int id = m_next++ % m_workers.size();
+	{
+		// count first so a thief never drives the counter negative
+		std::lock_guard<std::mutex> guard(m_sleepLock);
+		m_pending++;
+	}
+	{
+		std::lock_guard<std::mutex> guard(m_workers[id]->lock);
+		m_workers[id]->tasks.push_back(std::move(task));
+	}
+	m_wake.notify_one();
+}
+
+// parallelFor
+//
+// Runs body(0) .. body(count-1) on the pool and blocks until all 
+// of them are done. The calling thread steals work while it waits,
+// so it is safe to call from inside a task as well. It is re-entrant
+// across threads: several threads, workers or not, may be inside 
+// parallelFor at once, each waits for its own bodies only but runs
+// whatever task it steals meanwhile.
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& body) {
+	if (count <= 1) {
+		if (count == 1) body(0);
+		return;
+	}
+	std::atomic<int> remaining(count);
+	for (int i = 0; i < count; i++) {
+		submit([&body, &remaining, i]() {
+			body(i);
+			remaining--;
+		});
+	}
+	helpUntil([&remaining]() { return remaining == 0; });
+}
+
+// helpUntil
+//
+// Blocks until done() returns true, running queued tasks on the 
+// calling thread meanwhile. The wait for tasks given to submit.
+void ThreadPool::helpUntil(const std::function<bool()>& done) {
+	std::function<void()> task;
+	while (!done()) {
+		if (popTask(-1, task)) task();
+		else std::this_thread::yield();
+	}
+}
+
+// popTask
+//
+// Takes the newest task of worker 'self', otherwise steals the 
+// oldest task of any other worker. Pass self = -1 to only steal.
+bool ThreadPool::popTask(int self, std::function<void()>& task) {
+	int n = static_cast<int>(m_workers.size());
+	if (self >= 0) {
+		std::lock_guard<std::mutex> guard(m_workers[self]->lock);
+		if (!m_workers[self]->tasks.empty()) {
+			task = std::move(m_workers[self]->tasks.back());
+			m_workers[self]->tasks.pop_back();
+			m_pending--;
+			return true;
+		}
+	}
+	for (int i = 1; i <= n; i++) {
+		int victim = (self + i + n) % n;
+		if (victim == self) continue;
+		std::lock_guard<std::mutex> guard(m_workers[victim]->lock);
+		if (!m_workers[victim]->tasks.empty()) {
+			task = std::move(m_workers[victim]->tasks.front());
+			m_workers[victim]->tasks.pop_front();
+			m_pending--;
+			return true;
+		}
+	}
+	return false;
+}
+
+// workerLoop
+//
+// Runs tasks until the pool is stopped and nothing is left.
+void ThreadPool::workerLoop(int id) {
+	std::function<void()> task;
+	while (true) {
+		if (popTask(id, task)) {
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(m_sleepLock);
+		m_wake.wait(lock, [this]() { return m_stop || m_pending > 0; });
+		if (m_stop && m_pending <= 0) return;
+	}
+}
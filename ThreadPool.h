@@ -0,0 +1,41 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// class ThreadPool
+//
+// Persistent pool of worker threads with one task deque per worker.
+// A worker pops from the back of its own deque and, when that runs
+// dry, steals from the front of the others. Threads are created once
+// and reused for every resample, so there is no per-call spawn cost.
+class ThreadPool {
+public:
+	ThreadPool(unsigned int threads);
+	~ThreadPool();
+
+	void submit(std::function<void()> task);
+	void parallelFor(int count, const std::function<void(int)>& body);
+	void helpUntil(const std::function<bool()>& done);
+	unsigned int size() const { return static_cast<unsigned int>(m_threads.size()); }
+
+private:
+	struct Worker {
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+	bool popTask(int self, std::function<void()>& task);
+	void workerLoop(int id);
+
+	std::vector<Worker*> m_workers;
+	std::vector<std::thread> m_threads;
+	std::mutex m_sleepLock;
+	std::condition_variable m_wake;
+	std::atomic<int> m_pending;
+	std::atomic<unsigned int> m_next;
+	bool m_stop;
+};
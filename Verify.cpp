@@ -0,0 +1,169 @@
+#include "Verify.h"
+#include "Benchmark.h"
+#include <algorithm>
+#include <filesystem>
+#include <math.h>
+#include <string.h>
+
+// Tap
+//
+// Source index and weight of the right / lower tap for one
+// destination column or row, exact and as the FIXED kernel rounds it.
+typedef struct {
+	int index;
+	double exact;
+	double quantized;
+} Tap;
+
+// sampleTaps
+//
+// Sampling points of ResampleBillinear, position i * (srcSize - 1) /
+// dstSize, in exact integer arithmetic.
+static std::vector<Tap> sampleTaps(int srcSize, int dstSize) {
+	std::vector<Tap> taps(dstSize);
+	for (int i = 0; i < dstSize; i++) {
+		int64_t pos = static_cast<int64_t>(i) * (srcSize - 1);
+		int64_t rem = pos % dstSize;
+		taps[i].index = static_cast<int>(pos / dstSize);
+		taps[i].exact = static_cast<double>(rem) / dstSize;
+		taps[i].quantized = static_cast<double>((rem * FIXED_ONE + dstSize / 2) / dstSize) / FIXED_ONE;
+	}
+	return taps;
+}
+
+// With quantized weights every term is a multiple of 2^-16 below
+// 2^8, so the double result is exact.
+static inline double bilinear(double p00, double p10, double p01, double p11, double tx, double ty) {
+	return (1.0 - ty) * ((1.0 - tx) * p00 + tx * p10) + ty * ((1.0 - tx) * p01 + tx * p11);
+}
+
+static inline int roundHalfUp(double v) {
+	return static_cast<int>(floor(v + 0.5));
+}
+
+static void copyImage(const Image* src, Image* dst) {
+	*dst = *src;
+	dst->mapBase = NULL;
+	dst->mapLength = 0;
+	dst->data = newMemory<unsigned char>(src->imageSize, 0);
+	memcpy(dst->data, src->data, src->imageSize);
+}
+
+// verifyCase
+//
+// Resamples src with the FIXED and the SEPARABLE kernel and compares
+// both against the references, see runVerification.
+//
+// @return false if FIXED differs from the quantized reference or by
+//         more than one LSB from the exact one
+static bool verifyCase(TargaHandler* handler, const char* name, const Image* src, float sx, float sy) {
+	int newWidth = static_cast<int>(src->width * sx);
+	int newHeight = static_cast<int>(src->height * sy);
+	if (newWidth <= 0 || newHeight <= 0) return true;
+
+	Image fixed, separable;
+	copyImage(src, &fixed);
+	handler->setKernel(FIXED);
+	handler->ResampleBillinear(&fixed, sx, sy);
+	copyImage(src, &separable);
+	handler->setKernel(SEPARABLE);
+	handler->ResampleBillinear(&separable, sx, sy);
+
+	const std::vector<Tap> tx = sampleTaps(src->width, newWidth);
+	const std::vector<Tap> ty = sampleTaps(src->height, newHeight);
+	const int bpp = src->bpp;
+	const size_t rowStride = static_cast<size_t>(src->width) * bpp;
+	int64_t mismatches = 0;
+	int maxFixed = 0, maxSeparable = 0;
+	double sumFixed = 0.0, sumSeparable = 0.0;
+	for (int y = 0; y < newHeight; y++) {
+		const Tap& v = ty[y];
+		const unsigned char* r0 = src->data + v.index * rowStride;
+		const unsigned char* r1 = (v.index + 1 < src->height) ? r0 + rowStride : r0;
+		for (int x = 0; x < newWidth; x++) {
+			const Tap& u = tx[x];
+			const int right = (u.index + 1 < src->width) ? bpp : 0;
+			const unsigned char* p0 = r0 + u.index * bpp;
+			const unsigned char* p1 = r1 + u.index * bpp;
+			const size_t at = (static_cast<size_t>(y) * newWidth + x) * bpp;
+			for (int c = 0; c < bpp; c++) {
+				double exact = bilinear(p0[c], p0[c + right], p1[c], p1[c + right], u.exact, v.exact);
+				double quantized = bilinear(p0[c], p0[c + right], p1[c], p1[c + right], u.quantized, v.quantized);
+				int f = fixed.data[at + c];
+				int s = separable.data[at + c];
+				if (f != roundHalfUp(quantized)) mismatches++;
+				maxFixed = std::max(maxFixed, abs(f - roundHalfUp(exact)));
+				maxSeparable = std::max(maxSeparable, abs(s - roundHalfUp(exact)));
+				sumFixed += f - exact;
+				sumSeparable += s - exact;
+			}
+		}
+	}
+	handler->freeImage(&fixed);
+	handler->freeImage(&separable);
+
+	bool pass = (mismatches == 0) && (maxFixed <= 1);
+	double count = static_cast<double>(newWidth) * newHeight * bpp;
+	printf("  %-20s %5dx%-5d %2dbpp %5.3f x %-5.3f %s  fixed: %lld mismatches, max %d bias %+.3f  float: max %d bias %+.3f\n",
+		name, src->width, src->height, bpp * 8, sx, sy, pass ? "ok  " : "FAIL",
+		static_cast<long long>(mismatches), maxFixed, sumFixed / count, maxSeparable, sumSeparable / count);
+	return pass;
+}
+
+// runVerification
+bool runVerification(const char* sampleDir, unsigned int threads) {
+	namespace fs = std::filesystem;
+	const float scales[][2] = {
+		{ 0.1f, 0.1f }, { 0.25f, 0.25f }, { 0.33f, 0.33f }, { 0.5f, 0.5f }, { 0.77f, 0.77f },
+		{ 1.0f, 1.0f }, { 1.5f, 1.5f }, { 2.3f, 2.3f }, { 0.6f, 1.3f }
+	};
+	// odd sizes leave a lone last column and partial SIMD blocks
+	const int sizes[][2] = { { 97, 61 }, { 640, 480 } };
+	const int bpps[] = { 3, 4 };
+
+	TargaHandler handler;
+	handler.setVerbose(false);
+	handler.setThreadCount(threads);
+	// 1/N scales are sampled too, not box filtered
+	handler.setBoxFilter(false);
+	int cases = 0, failed = 0;
+	auto verifyScales = [&](const char* name, const Image* img) {
+		for (auto const& s : scales) {
+			cases++;
+			if (!verifyCase(&handler, name, img, s[0], s[1])) failed++;
+		}
+	};
+
+	std::error_code ec;
+	std::vector<fs::path> samples;
+	for (auto const& f : fs::directory_iterator(sampleDir, ec)) {
+		if (f.is_regular_file() && f.path().extension() == ".tga") samples.push_back(f.path());
+	}
+	std::sort(samples.begin(), samples.end());
+	if (samples.empty()) printf("No samples in \"%s\", synthetic images only\n", sampleDir);
+	for (auto const& path : samples) {
+		Image img;
+		if (!handler.loadTGA(path.string().c_str(), &img)) {
+			printf("Could not load \"%s\"\n", path.string().c_str());
+			cases++;
+			failed++;
+			continue;
+		}
+		verifyScales(path.filename().string().c_str(), &img);
+		handler.freeImage(&img);
+	}
+
+	for (auto const& size : sizes) {
+		for (int bpp : bpps) {
+			for (int c = FLAT; c <= NOISE; c++) {
+				Image img;
+				generateImage(&img, size[0], size[1], bpp, static_cast<CONTENT>(c));
+				verifyScales(contentName[c], &img);
+				handler.freeImage(&img);
+			}
+		}
+	}
+
+	printf("FIXED kernel: %d of %d cases passed\n", cases - failed, cases);
+	return failed == 0;
+}
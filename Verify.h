@@ -0,0 +1,21 @@
+#pragma once
+#include "targaHandler.h"
+
+// runVerification
+//
+// Checks the FIXED bilinear kernel against a double precision
+// reference on every TGA in sampleDir and on synthetic 24 and 32 bit
+// images (flat, gradient, noise, see generateImage) at downscale,
+// identity and upscale factors. Two references are computed per
+// destination component from the same sampling points:
+//   quantized - bilinear with the 8.8 weights of getFixedTable,
+//               rounded half up; FIXED has to match it bit for bit
+//   exact     - bilinear with exact weights, rounded half up; FIXED
+//               has to stay within one LSB of it
+// The float SEPARABLE kernel is measured against the exact reference
+// as well, for comparison. Results are printed per case.
+//
+// @param sampleDir - directory of sample images, e.g. DefaultFiles
+//
+// @return false if any case fails either check
+bool runVerification(const char* sampleDir, unsigned int threads);
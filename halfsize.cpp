@@ -1,8 +1,227 @@
 #include "targaHandler.h"
+#include "BatchProcessor.h"
+#include "Benchmark.h"
+#include "Metrics.h"
+#include "ResizeServer.h"
+#include "ResultCache.h"
+#include "Verify.h"
+#include <chrono>
+#include <filesystem>
+#include <string.h>
+#include <vector>
 #define DEFAULT_INPUT "DefaultFiles/testpattern_rle.tga"
 #define DEFAULT_OUTPUT "outputUC.tga"
 #define DEFAULT_SX 0.5f
 #define DEFAULT_SY 0.5f
+#define DEFAULT_CACHE_MB 1024
+
+// Options
+//
+// Command line settings shared by all modes.
+typedef struct {
+	unsigned int threads;
+	bool mapFiles;
+	COMPRESSION compression;
+	bool boxFilter;
+	FILTER filter;
+	KERNEL kernel;
+	int tileWidth;
+	int tileHeight;
+	bool padded;
+	bool metrics;
+	bool asyncIO;
+	const char* cacheDir;
+	unsigned int cacheMB;
+	bool cacheLinks;
+} Options;
+
+// configure
+//
+// Applies the resampling options to a handler.
+static void configure(TargaHandler* handler, const Options& opt) {
+	handler->setThreadCount(opt.threads);
+	handler->setMemoryMapping(opt.mapFiles);
+	handler->setBoxFilter(opt.boxFilter);
+	handler->setFilter(opt.filter);
+	handler->setKernel(opt.kernel);
+	handler->setTileSize(opt.tileWidth, opt.tileHeight);
+	handler->setPaddedLayout(opt.padded);
+}
+
+// openCache
+//
+// The -cache result cache, NULL when not asked for.
+static ResultCache* openCache(const Options& opt) {
+	if (opt.cacheDir == NULL) return NULL;
+	ResultCache* cache = new ResultCache(opt.cacheDir, static_cast<uint64_t>(opt.cacheMB) << 20);
+	cache->setHardLinks(opt.cacheLinks);
+	return cache;
+}
+
+// runBatch
+//
+// Batch mode, positional arguments are either
+//   manifest.txt [scale_x [scale_y]]
+//   inputDir outputDir [scale_x [scale_y]]
+// where the manifest lists "input output [scale_x [scale_y]]" per line.
+static int runBatch(int argc, char* argv[], const Options& opt) {
+	if (argc < 2) {
+		printf("-batch requires a manifest file or an input directory\n");
+		return 1;
+	}
+	BatchProcessor batch;
+	batch.setThreadCount(opt.threads);
+	batch.setMemoryMapping(opt.mapFiles);
+	batch.setCompression(opt.compression);
+	batch.setBoxFilter(opt.boxFilter);
+	batch.setFilter(opt.filter);
+	batch.setKernel(opt.kernel);
+	batch.setTileSize(opt.tileWidth, opt.tileHeight);
+	batch.setPaddedLayout(opt.padded);
+	batch.setAsyncIO(opt.asyncIO);
+	ResultCache* cache = openCache(opt);
+	batch.setCache(cache);
+
+	bool isDir = std::filesystem::is_directory(argv[1]);
+	int scaleArg = isDir ? 3 : 2;
+	if (isDir && argc < 3) {
+		printf("-batch with an input directory requires an output directory\n");
+		return 1;
+	}
+	float sx = (argc > scaleArg) ? sc_float(atof(argv[scaleArg])) : DEFAULT_SX;
+	float sy = (argc > scaleArg + 1) ? sc_float(atof(argv[scaleArg + 1])) : sx;
+	if (sx <= 0 || sy <= 0) {
+		printf("scaling req. floating point values > 0, using default 0.5\n");
+		sx = DEFAULT_SX;
+		sy = DEFAULT_SY;
+	}
+
+	bool added = isDir ? batch.addDirectory(argv[1], argv[2], sx, sy)
+	                   : batch.addManifest(argv[1], sx, sy);
+	if (!added) {
+		delete cache;
+		return 1;
+	}
+
+	bool success = batch.run();
+	batch.printReport();
+	if (cache != NULL) cache->printReport();
+	delete cache;
+	if (opt.metrics) printf("%s", metricsToJSON(batch.poolStats()).c_str());
+	return success ? 0 : 1;
+}
+
+// printMetrics
+//
+// JSON dump of Metrics.h, pools are read before the handler 
+// releases them.
+static void printMetrics() {
+	std::vector<PoolStats> pools;
+	getPoolStats(pools);
+	printf("%s", metricsToJSON(pools).c_str());
+}
+
+// runMulti
+//
+// Multi output mode, positional arguments are
+//   input.tga output=size [output=size ...]
+// where size is a scale (0.5), a WxH size (640x480) or a longest 
+// side in pixels (256px). The input is decoded once, e.g.
+//   in.tga full.tga=1 half.tga=0.5 quarter.tga=0.25 thumb.tga=256px
+static int runMulti(int argc, char* argv[], const Options& opt) {
+	if (argc < 3) {
+		printf("-multi requires an input file and at least one output=size\n");
+		return 1;
+	}
+	std::vector<ResizeTarget> targets;
+	for (int i = 2; i < argc; i++) {
+		const char* eq = strrchr(argv[i], '=');
+		if (eq == NULL || eq == argv[i]) {
+			printf("Expected output=size, got \"%s\"\n", argv[i]);
+			return 1;
+		}
+		ResizeTarget t = { std::string(argv[i], eq - argv[i]), 0, 0, 0, 0 };
+		const char* size = eq + 1;
+		int w = 0, h = 0;
+		if (strchr(size, 'x') != NULL && sscanf(size, "%dx%d", &w, &h) == 2) {
+			t.width = w;
+			t.height = h;
+		}
+		else if (strstr(size, "px") != NULL) t.fit = atoi(size);
+		else t.scale = sc_float(atof(size));
+		targets.push_back(t);
+	}
+
+	TargaHandler handler;
+	configure(&handler, opt);
+	auto start = std::chrono::steady_clock::now();
+	bool success = handler.resizeMulti(argv[1], targets, opt.compression);
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	if (success) printf("Wrote %zu outputs (%.2f ms)\n", targets.size(), elapsed.count());
+	else printf("%s terminates due to error...\n", argv[0]);
+	if (opt.metrics) printMetrics();
+	return success ? 0 : 1;
+}
+
+// runServe
+//
+// Server mode, positional arguments are
+//   socket [workers]
+// see ResizeServer for the protocol. Runs until a client sends QUIT.
+static int runServe(int argc, char* argv[], const Options& opt) {
+	if (argc < 2) {
+		printf("-serve requires a socket path\n");
+		return 1;
+	}
+	unsigned int workers = (argc > 2) ? static_cast<unsigned int>(atoi(argv[2])) : 2;
+	ResizeServer server(workers);
+	server.setThreadCount(opt.threads);
+	server.setMemoryMapping(opt.mapFiles);
+	server.setBoxFilter(opt.boxFilter);
+	server.setFilter(opt.filter);
+	server.setKernel(opt.kernel);
+	server.setTileSize(opt.tileWidth, opt.tileHeight);
+	server.setPaddedLayout(opt.padded);
+	if (!server.run(argv[1])) return 1;
+	server.printReport();
+	if (opt.metrics) printMetrics();
+	return 0;
+}
+
+// runClient
+//
+// Client of -serve, positional arguments are
+//   socket input.tga output.tga [scale_x [scale_y]]
+// or "socket quit" to stop the server. Paths are made absolute since
+// the server may run in another directory, fields are sent tab
+// separated (see ResizeServer).
+static int runClient(int argc, char* argv[], const Options& opt) {
+	std::string request;
+	if (argc == 3 && strcmp(argv[2], "quit") == 0) request = "QUIT";
+	else if (argc >= 4) {
+		float sx = (argc > 4) ? sc_float(atof(argv[4])) : DEFAULT_SX;
+		float sy = (argc > 5) ? sc_float(atof(argv[5])) : sx;
+		if (sx <= 0 || sy <= 0) {
+			printf("scaling req. floating point values > 0, using default 0.5\n");
+			sx = DEFAULT_SX;
+			sy = DEFAULT_SY;
+		}
+		char scales[64];
+		snprintf(scales, sizeof(scales), "\t%.9g\t%.9g\t", sx, sy);
+		request = std::filesystem::absolute(argv[2]).string() + "\t"
+		        + std::filesystem::absolute(argv[3]).string() + scales
+		        + ((opt.compression == RLE) ? "rle" : "uncompressed");
+	}
+	else {
+		printf("-client requires a socket, an input and an output file (or quit)\n");
+		return 1;
+	}
+	std::string reply;
+	if (!sendResizeRequest(argv[1], request, &reply)) return 1;
+	printf("%s\n", reply.c_str());
+	return (reply.compare(0, 2, "OK") == 0) ? 0 : 1;
+}
+
 
 int main(int argc, char* argv[]){
 	// optional / default params
@@ -10,6 +229,97 @@ int main(int argc, char* argv[]){
 	char* fileToWrite = DEFAULT_OUTPUT;
 	float scale_x = DEFAULT_SX;
 	float scale_y = DEFAULT_SY;
+	bool batch = false;
+	bool stream = false;
+	bool poolStats = false;
+	bool bench = false;
+	bool multi = false;
+	bool serve = false;
+	bool client = false;
+	bool verify = false;
+	Options opt = { 1, false, UNCOMPRESSED, true, BILINEAR, SEPARABLE, 0, 0, false, false, false, NULL, DEFAULT_CACHE_MB, false };
+
+	// Options are stripped first, what is left are the 
+	// positional arguments handled below.
+	//   -threads N : resample on N threads (0 = all cores)
+	//   -batch     : pipelined batch mode, see runBatch
+	//   -mmap      : map uncompressed inputs instead of reading them
+	//   -rle       : write RLE compressed output
+	//   -stream    : resize scanline by scanline, memory grows with width only
+	//   -poolstats : print memory pool reuse before exiting
+	//   -bench     : run the benchmark suite, see below
+	//   -metrics   : print per stage timings and counters as JSON
+	//   -bilinear  : no box filter for 1/N scales, always bilinear
+	//   -multi     : decode once, write several sizes, see runMulti
+	//   -filter F  : bilinear (default), bicubic or lanczos3
+	//   -tile WxH  : bilinear over WxH destination tiles instead of row bands
+	//   -fixed     : bilinear in 8.8 fixed point, rounded to nearest
+	//   -verify    : check -fixed against a reference, see below
+	//   -padded    : hold 24 bit images as 4 byte pixels until saving
+	//   -uring     : batch reads and writes through io_uring (Linux)
+	//   -serve     : resident server on a Unix socket, see runServe
+	//   -client    : send one job to a -serve server, see runClient
+	//   -cache DIR : reuse results of earlier runs stored in DIR
+	//   -cachesize MB : size cap of the -cache directory
+	//   -cachelink : hand out cached results as hard links
+	std::vector<char*> args;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			opt.threads = static_cast<unsigned int>(atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-batch") == 0) batch = true;
+		else if (strcmp(argv[i], "-mmap") == 0) opt.mapFiles = true;
+		else if (strcmp(argv[i], "-rle") == 0) opt.compression = RLE;
+		else if (strcmp(argv[i], "-stream") == 0) stream = true;
+		else if (strcmp(argv[i], "-poolstats") == 0) poolStats = true;
+		else if (strcmp(argv[i], "-bench") == 0) bench = true;
+		else if (strcmp(argv[i], "-metrics") == 0) opt.metrics = true;
+		else if (strcmp(argv[i], "-bilinear") == 0) opt.boxFilter = false;
+		else if (strcmp(argv[i], "-multi") == 0) multi = true;
+		else if (strcmp(argv[i], "-filter") == 0 && i + 1 < argc) {
+			const char* name = argv[++i];
+			if (strcmp(name, "bicubic") == 0) opt.filter = BICUBIC;
+			else if (strcmp(name, "lanczos3") == 0) opt.filter = LANCZOS3;
+			else if (strcmp(name, "bilinear") == 0) opt.filter = BILINEAR;
+			else printf("Unknown filter \"%s\", using bilinear\n", name);
+		}
+		else if (strcmp(argv[i], "-padded") == 0) opt.padded = true;
+		else if (strcmp(argv[i], "-fixed") == 0) opt.kernel = FIXED;
+		else if (strcmp(argv[i], "-verify") == 0) verify = true;
+		else if (strcmp(argv[i], "-uring") == 0) opt.asyncIO = true;
+		else if (strcmp(argv[i], "-serve") == 0) serve = true;
+		else if (strcmp(argv[i], "-client") == 0) client = true;
+		else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) opt.cacheDir = argv[++i];
+		else if (strcmp(argv[i], "-cachesize") == 0 && i + 1 < argc) {
+			opt.cacheMB = static_cast<unsigned int>(atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-cachelink") == 0) opt.cacheLinks = true;
+		else if (strcmp(argv[i], "-tile") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &opt.tileWidth, &opt.tileHeight) != 2)
+				printf("-tile expects WxH, e.g. 256x64\n");
+		}
+		else args.push_back(argv[i]);
+	}
+	argc = static_cast<int>(args.size());
+	argv = args.data();
+
+	if (multi) return runMulti(argc, argv, opt);
+	if (serve) return runServe(argc, argv, opt);
+	if (client) return runClient(argc, argv, opt);
+	if (batch) return runBatch(argc, argv, opt);
+
+	// benchmark: [results.csv [max image size]]
+	if (bench) {
+		const char* results = (argc > 1) ? argv[1] : "bench_results.csv";
+		int maxSize = (argc > 2) ? atoi(argv[2]) : 4096;
+		return runBenchmark(results, maxSize, opt.threads) ? 0 : 1;
+	}
+
+	// fixed point kernel check: [sample directory]
+	if (verify) {
+		const char* samples = (argc > 1) ? argv[1] : "DefaultFiles";
+		return runVerification(samples, opt.threads) ? 0 : 1;
+	}
 
 	// Simple if/else for handling user input
 	if (argc == 5) {
@@ -47,8 +357,22 @@ int main(int argc, char* argv[]){
 	}
 	printf("Reading: \"%s\"...\n", fileToRead);
 
+	// a cached result needs no decoding at all
+	ResultCache* cache = stream ? NULL : openCache(opt);
+	std::string cacheKey;
+	if (cache != NULL) {
+		cacheKey = cache->key(fileToRead, scale_x, scale_y, opt.filter, opt.kernel, opt.boxFilter, opt.compression);
+		if (cache->fetch(cacheKey, fileToWrite)) {
+			printf("Cached result: \"%s\"\n", fileToWrite);
+			cache->printReport();
+			delete cache;
+			return 0;
+		}
+	}
+
 	Image image;
 	TargaHandler* targaHandler = new TargaHandler();
+	configure(targaHandler, opt);
 
 	//targaHandler->setExpectedRuns(2); 
 	//
@@ -63,20 +387,35 @@ int main(int argc, char* argv[]){
 	// unset, where the allocation defaults to a standard 1:1 
 	// allocation scheme.  
 
+	if (stream) {
+		auto start = std::chrono::steady_clock::now();
+		bool streamed = targaHandler->resizeStreaming(fileToRead, fileToWrite, scale_x, scale_y, opt.compression);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (streamed) printf("Streamed to: \"%s\" (%.2f ms)\n", fileToWrite, elapsed.count());
+		else printf("%s terminates due to error...\n", argv[0]);
+		if (poolStats) targaHandler->printMemoryStats();
+		if (opt.metrics) printMetrics();
+		delete targaHandler;
+		return streamed ? 0 : 1;
+	}
+
 	bool success = targaHandler->loadTGA(fileToRead, &image);
 	if (success) {
 		printf("Done.\n");
 		printf("Original size: %ix%i\n", image.width, image.height);
 
+		auto start = std::chrono::steady_clock::now();
 		targaHandler->ResampleBillinear(&image, scale_x, scale_y);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
 
-		printf("Resized to: %ix%i\n", image.width, image.height);
+		printf("Resized to: %ix%i (%.2f ms)\n", image.width, image.height, elapsed.count());
 		printf("Saving: \"%s\"... \n", fileToWrite);
 
-		success = targaHandler->saveTGA(fileToWrite, &image, UNCOMPRESSED);
+		success = targaHandler->saveTGA(fileToWrite, &image, opt.compression);
 
 		if (success) {
 			printf("Done.\n");
+			if (cache != NULL) cache->store(cacheKey, fileToWrite);
 		}else {
 			printf("Could not save file: \"%s\" \n", fileToWrite);
 		}
@@ -84,6 +423,10 @@ int main(int argc, char* argv[]){
 		printf("%s terminates due to error...\n", argv[0]);
 	}
 
+	if (poolStats) targaHandler->printMemoryStats();
+	if (opt.metrics) printMetrics();
+	if (cache != NULL) cache->printReport();
+	delete cache;
 	delete targaHandler;
 
     return 0;
@@ -2,10 +2,26 @@
 #ifndef TARGAHANDLER_H
 #define TARGAHANDLER_H
 #include <stdio.h>
+#include "AsyncIO.h"
 #include "MemoryManager.h"
+#include "ThreadPool.h"
+#include <map>
+#include <string>
+#include <vector>
 
 #define sc_uchar(x) static_cast<unsigned char>(x)
 #define sc_float(x) static_cast<float>(x)
+// largest fx * fy block the box kernel averages, sums stay in 16 bits
+#define BOX_MAX_AREA 256
+// widest destination tile of resampleTiles, its rows live on the stack
+#define TILE_MAX_WIDTH 512
+// fewest pixels one worker of the parallel RLE decoder expands
+#define RLE_MIN_SEGMENT (64 * 1024)
+// fewest pixels one worker of the parallel RLE encoder packs
+#define RLE_MIN_CHUNK (64 * 1024)
+// fraction bits of the FIXED kernel's weights, 8.8 fixed point
+#define FIXED_BITS 8
+#define FIXED_ONE (1 << FIXED_BITS)
 
 // Header
 //
@@ -28,16 +44,122 @@ typedef struct {
 
 // Image
 //
-// Holds read data from a TGA image at runtime
+// Holds read data from a TGA image at runtime. When the image was
+// loaded through a memory mapping, data points into the mapping at
+// mapBase and the pixels do not belong to any MemoryManager.
+// A padded image is a 24 bit image held as 4 byte pixels (bpp 4),
+// see TargaHandler::setPaddedLayout.
 typedef struct {
 	int width;
 	int height;
 	int bpp;
 	int imageSize;
 	unsigned char *data;
+	unsigned char *mapBase;
+	size_t mapLength;
+	bool padded;
 } Image;
 
+// ResampleTable
+//
+// Source column/row index and interpolation weight for every
+// destination column/row of one (srcW, srcH, dstW, dstH) geometry.
+// Built once and shared by all images of that geometry.
+typedef struct {
+	std::vector<int>   xIdx;
+	std::vector<float> xWeight;
+	std::vector<int>   yIdx;
+	std::vector<float> yWeight;
+} ResampleTable;
+
+// FixedTable
+//
+// ResampleTable of the FIXED kernel. Same sampling points, but found
+// with integer arithmetic, and the weight of the right / lower tap is
+// rounded to FIXED_BITS fraction bits (0 .. FIXED_ONE).
+typedef struct {
+	std::vector<int>      xIdx;
+	std::vector<uint16_t> xWeight;
+	std::vector<int>      yIdx;
+	std::vector<uint16_t> yWeight;
+} FixedTable;
+
+// FilterTable
+//
+// Window start and taps weights of every destination sample along
+// one axis for the BICUBIC / LANCZOS3 filters, see getFilterTable.
+typedef struct {
+	int taps;
+	std::vector<int>   start;
+	std::vector<float> weight;
+} FilterTable;
+
+// SourceStream
+//
+// Read state of a TGA file that is decoded one scanline at a time.
+// For RLE input the packet being expanded may continue on the next
+// scanline, so its remaining count and run colour are kept here.
+typedef struct {
+	FILE* file;
+	int width;
+	int height;
+	int bpp;
+	bool rle;
+	bool bottomUp;
+	int nextRow;
+	unsigned char* buff;
+	size_t buffSize;
+	size_t buffLen;
+	size_t buffPos;
+	unsigned int packetLeft;
+	bool packetRun;
+	unsigned char runPixel[4];
+} SourceStream;
+
+// ResizeTarget
+//
+// One output of resizeMulti. The size is taken from the first of
+// fit, width/height and scale that is set.
+typedef struct {
+	std::string filename;
+	float scale;   // of the input, as for ResampleBillinear
+	int width;     // 0 follows height, keeping the aspect ratio
+	int height;    // 0 follows width
+	int fit;       // > 0: longest side becomes fit, aspect kept
+} ResizeTarget;
+
+// PendingLoad
+//
+// A load split in two for callers doing their own I/O (see the
+// io_uring backend of BatchProcessor): beginLoad sets the Image up
+// from the header bytes and says which bytes of the file go where,
+// finishLoad completes the Image once they were read.
+typedef struct {
+	size_t offset;          // file offset of the pixel or packet data
+	size_t length;          // bytes to read from there
+	unsigned char* buffer;  // destination, img->data or a packet buffer
+	size_t bufferSize;
+	bool rle;
+	bool bottomUp;
+} PendingLoad;
+
+// EncodedImage
+//
+// An Image ready to be written: the 18 header bytes followed by the
+// parts, length bytes in all. Parts either point into the image 
+// itself or into an owned buffer, see encodeTGA / releaseEncoded; an
+// image encoded in chunks has one part per chunk.
+typedef struct {
+	unsigned char header[18];
+	std::vector<IoVec> parts;
+	size_t length;
+	unsigned char* owned;
+	size_t ownedSize;
+} EncodedImage;
+
 enum COMPRESSION { UNCOMPRESSED = 0, RLE = 1 };
+enum KERNEL { SCALAR = 0, SIMD = 1, SEPARABLE = 2, FIXED = 3 };
+enum FILTER { BILINEAR = 0, BICUBIC = 1, LANCZOS3 = 2 };
 
 // class TartaHandler
 //
@@ -51,20 +173,84 @@ public:
 
 	bool loadTGA(const char *filename, Image* img);
 	bool saveTGA(const char *filename, Image* img, COMPRESSION comp);
+	bool writeTGA(const char *filename, const Image* img, COMPRESSION comp);
+	bool beginLoad(const unsigned char* header, size_t fileSize, Image* img, PendingLoad* load);
+	bool finishLoad(Image* img, PendingLoad* load, size_t bytesRead);
+	bool encodeTGA(const Image* img, COMPRESSION comp, EncodedImage* out);
+	void releaseEncoded(EncodedImage* e);
 	void ResampleBillinear(Image *img, const float scalex, const float scaley);
+	void resampleToSize(Image* img, int newWidth, int newHeight);
+	bool resizeMulti(const char* input, const std::vector<ResizeTarget>& targets, COMPRESSION comp);
+	bool resizeStreaming(const char* input, const char* output, float scalex, float scaley, COMPRESSION comp);
 	void setExpectedRuns(unsigned int runs);
+	void setKernel(KERNEL kernel);
+	void setFilter(FILTER filter);
+	void setBoxFilter(bool enable);
+	void setTileSize(int width, int height);
+	void setPaddedLayout(bool enable);
+	void setThreadCount(unsigned int threads);
+	void setMemoryMapping(bool enable);
+	void setVerbose(bool verbose);
+	void freeImage(Image* img);
+	void printMemoryStats();
 
 private:
-	bool loadCompressed(const char * filename, Image* img, FILE * filePtr);
-	bool loadUncompressed(const char * filename, Image* img, FILE * filePtr);
-	bool readPixel(unsigned char* p, Image* img, FILE* fPtr);
+	bool loadCompressed(const char * filename, Image* img, FILE * filePtr, bool bottomUp);
+	bool loadUncompressed(const char * filename, Image* img, FILE * filePtr, bool bottomUp);
+	bool loadMapped(const char * filename, Image* img);
+	bool imageFromHeader(Image* img);
+	bool decodePackets(const unsigned char* src, size_t srcLen, Image* img, bool bottomUp);
+	bool releaseData(Image* img);
+	void padImage(Image* img);
+	template<int BPP, bool BOTTOM_UP>
+	bool decodeRLE(const unsigned char* src, size_t srcLen, unsigned char* dst, int width, int height);
+	template<int BPP, bool BOTTOM_UP>
+	bool decodeRLEParallel(const unsigned char* src, size_t srcLen, unsigned char* dst, int width, int height);
+
+	bool openStream(const char* filename, SourceStream* s);
+	template<int BPP>
+	bool readScanline(SourceStream* s, unsigned char* row);
+	template<int BPP>
+	bool skipScanlines(SourceStream* s, int count);
+	bool fillStream(SourceStream* s, size_t need);
+	void closeStream(SourceStream* s);
+	template<int BPP>
+	bool streamRows(SourceStream* s, FILE* out, const ResampleTable* t, int newWidth, int newHeight, COMPRESSION comp);
 
-	bool saveUncompressed(Header* h, const char* filename, Image* img);
+	void initHeader(Header* h, int width, int height, int bpp, COMPRESSION comp);
+	void encodeUncompressed(const Image* img, EncodedImage* out);
+	void encodeCompressed(const Image* img, EncodedImage* out);
+	template<int BPP>
+	size_t encodeRLE(const unsigned char* src, unsigned int count, unsigned char* dst);
 
-	void storePixel(Image* img, unsigned char* pBuff, unsigned int buffIdx);
 	unsigned char getPixelVal(Image* img, int x, int y, int i);
-	void closeAndFree(Image* img, FILE* fPtr, unsigned char* buff = NULL);
+	void resampleInto(Image* img, Image* out, int newWidth, int newHeight, int fx, int fy);
+	void resampleScalar(Image* img, unsigned char* dst, int newWidth, int newHeight);
+	template<int BPP>
+	void resampleSIMD(Image* img, unsigned char* dst, int newWidth, int newHeight, int y0, int y1);
+	template<int BPP>
+	void resampleSeparable(Image* img, unsigned char* dst, const ResampleTable* t,
+	                       int newWidth, int x0, int x1, int y0, int y1, float* row0, float* row1);
+	template<int BPP>
+	void resampleFixed(Image* img, unsigned char* dst, const FixedTable* t,
+	                   int newWidth, int y0, int y1, uint16_t* row0, uint16_t* row1);
+	template<int BPP>
+	void resampleTiles(Image* img, unsigned char* dst, const ResampleTable* t, int newWidth, int newHeight);
+	template<int BPP>
+	void resampleBands(Image* img, unsigned char* dst, int newWidth, int newHeight);
+	template<int BPP>
+	void resampleBox(Image* img, unsigned char* dst, int newWidth, int newHeight, int fx, int fy);
+	template<int BPP>
+	void resampleFiltered(Image* img, unsigned char* dst, int newWidth, int newHeight);
+	const FilterTable* getFilterTable(FILTER filter, int srcSize, int dstSize);
+	int bandCount(int newHeight);
+	static int boxFactor(float scale);
+	static int sizeFactor(int size, int newSize);
+	const ResampleTable* getResampleTable(int srcW, int srcH, int dstW, int dstH);
+	const FixedTable* getFixedTable(int srcW, int srcH, int dstW, int dstH);
+	void formatHeader(const Header* h, unsigned char* bytes);
 	void writeHeader(Header *header, FILE* filePtr);
+	void parseHeader(const unsigned char* bytes);
 	void readHeader(FILE* filePtr);
 
 	inline float lerp(float s1, float s2, float t) { return s1 + (s2 - s1)*t; }
@@ -75,6 +261,19 @@ private:
 	Header m_header;
 
 	unsigned int m_runsExpected;
+	KERNEL m_kernel;
+	FILTER m_filter;
+	int m_tileWidth;
+	int m_tileHeight;
+	bool m_padded;
+	std::map<uint64_t, ResampleTable*> m_tableMap;
+	std::map<uint64_t, FixedTable*> m_fixedMap;
+	std::map<uint64_t, FilterTable*> m_filterMap;
+	ThreadPool* m_pool;
+	ScratchArena m_scratch;
+	bool m_mapFiles;
+	bool m_boxFilter;
+	bool m_verbose;
 	unsigned char* newData;
 };
 